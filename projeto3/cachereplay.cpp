@@ -0,0 +1,497 @@
+// Replays a memory-access trace through the emulator's cache models, without
+// emulating the program again:
+//
+//   g++ -O2 -pthread -o cachereplay cachereplay.cpp
+//   ./poximv3 <input> <output> <term_in> <term_out> --access-trace=run.bin
+//   ./cachereplay run.bin <output_file> [options]
+//
+// The trace is either written by --access-trace (binary records) or Dinero
+// "din" text: one access per line, a label (0 read, 1 write, 2 fetch; other
+// labels are skipped), a hex address and an optional size in bytes, 4 when
+// left out. Files are mapped and read in place; pipes and other files that
+// cannot be mapped are read through a buffer instead.
+//
+// Options take the emulator's syntax:
+//   --icache=SETS:WAYS:LINE[:POLICY] --dcache=SETS:WAYS:LINE[:POLICY]
+//   --dcache-write=through|back --dcache-write-miss=allocate|no-allocate
+//   --l2=SETS:WAYS:LINE[:POLICY] --l3=SETS:WAYS:LINE[:POLICY]
+//   --cache-traffic --miss-classes --reuse-distance[=LINE] --policy-seed=N
+//   --belady
+//   --explore=FILE --explore-threads=N
+//   --perf
+// With the emulator's defaults the #cache_mem: summary lines come out as
+// the emulator's own.
+#include <set>
+#include <sys/stat.h>
+
+#define POXIM_NO_MAIN
+#include "poximv3.cpp"
+
+// Hands out a file in windows of bytes. The `keep` bytes a caller did not
+// consume at the end of one window start the next one.
+class TraceSource {
+public:
+  explicit TraceSource(const char *path) : fd(::open(path, O_RDONLY)) {
+    if (fd < 0)
+      fail(path, "cannot open");
+    struct stat status;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+        status.st_size > 0) {
+      void *mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd,
+                           0);
+      if (mapping != MAP_FAILED) {
+        madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+        mapped = static_cast<const char *>(mapping);
+        mappedSize = status.st_size;
+        return;
+      }
+    }
+    buffer.reset(new char[BUFFER]);
+    firstSize = load(0);
+  }
+
+  ~TraceSource() {
+    if (mapped)
+      munmap(const_cast<char *>(mapped), mappedSize);
+    ::close(fd);
+  }
+
+  // The start of the file, before the first next().
+  std::string_view head() const {
+    return mapped ? std::string_view(mapped, mappedSize)
+                  : std::string_view(buffer.get(), firstSize);
+  }
+
+  // Returns false when the file has no more bytes; `window` then holds only
+  // what was kept.
+  bool next(size_t keep, std::string_view &window) {
+    if (!started) {
+      started = true;
+      window = head();
+      return !window.empty();
+    }
+    if (mapped) {
+      window = window.substr(window.size() - keep);
+      return false;
+    }
+    std::memmove(buffer.get(), window.data() + window.size() - keep, keep);
+    const size_t size = load(keep);
+    window = std::string_view(buffer.get(), size);
+    return size > keep;
+  }
+
+  [[noreturn]] static void fail(const char *what, const char *why) {
+    std::cerr << "FATAL: " << what << ": " << why << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+private:
+  static constexpr size_t BUFFER = 1 << 20;
+
+  int fd;
+  const char *mapped = nullptr;
+  size_t mappedSize = 0;
+  bool started = false;
+  std::unique_ptr<char[]> buffer;
+  size_t firstSize = 0;
+
+  // Reads into the buffer after its first `size` bytes until it is full or
+  // the file ends, and returns how many bytes it then holds.
+  size_t load(size_t size) {
+    ssize_t got = 0;
+    while (size < BUFFER &&
+           (got = ::read(fd, buffer.get() + size, BUFFER - size)) > 0)
+      size += got;
+    if (got < 0)
+      fail("trace", "read failed");
+    return size;
+  }
+};
+
+// Calls `visit` with every AccessRecord of a binary access trace.
+template <class Visit> void readBinary(TraceSource &source, Visit &&visit) {
+  std::string_view window;
+  size_t keep = 0;
+  size_t skip = sizeof(AccessTraceHeader);
+  while (source.next(keep, window)) {
+    if (skip) {
+      if (window.size() < skip)
+        TraceSource::fail("trace", "truncated header");
+      AccessTraceHeader header;
+      std::memcpy(&header, window.data(), sizeof(header));
+      if (header.recordSize != sizeof(AccessRecord))
+        TraceSource::fail("trace", "unexpected record size");
+      window.remove_prefix(skip);
+      skip = 0;
+    }
+    const size_t count = window.size() / sizeof(AccessRecord);
+    for (size_t i = 0; i < count; ++i) {
+      AccessRecord record;
+      std::memcpy(&record, window.data() + i * sizeof(record), sizeof(record));
+      visit(record.address, record.size, record.label);
+    }
+    keep = window.size() - count * sizeof(AccessRecord);
+  }
+  if (keep)
+    TraceSource::fail("trace", "truncated record");
+}
+
+// Parses one din line; returns false if it is malformed.
+template <class Visit>
+bool readDinLine(std::string_view line, Visit &visit) {
+  const char *at = line.data();
+  const char *const end = at + line.size();
+  auto blanks = [&] {
+    while (at < end && (*at == ' ' || *at == '\t' || *at == '\r'))
+      ++at;
+  };
+  auto number = [&](int base, uint64_t &value) {
+    const char *start = at;
+    value = 0;
+    if (base == 16 && end - at > 2 && at[0] == '0' &&
+        (at[1] == 'x' || at[1] == 'X'))
+      at += 2;
+    for (; at < end; ++at) {
+      const char c = *at;
+      int digit;
+      if (c >= '0' && c <= '9')
+        digit = c - '0';
+      else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        digit = (c | 0x20) - 'a' + 10;
+      else
+        break;
+      value = value * base + digit;
+    }
+    return at > start;
+  };
+
+  blanks();
+  if (at == end)
+    return true;
+  uint64_t label, address, size = 4;
+  if (!number(10, label))
+    return false;
+  blanks();
+  if (!number(16, address))
+    return false;
+  blanks();
+  if (at < end && !number(10, size))
+    return false;
+  if (label <= 2)
+    visit(static_cast<uint32_t>(address), static_cast<uint32_t>(size),
+          static_cast<uint8_t>(label));
+  return true;
+}
+
+// Calls `visit` with every access of a din trace.
+template <class Visit> void readDin(TraceSource &source, Visit &&visit) {
+  std::string_view window;
+  size_t keep = 0;
+  uint64_t lineNumber = 0;
+  auto line = [&](std::string_view text) {
+    ++lineNumber;
+    if (!readDinLine(text, visit)) {
+      std::cerr << "FATAL: din trace line " << lineNumber
+                << ": expected LABEL ADDRESS [SIZE]" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  };
+  while (source.next(keep, window)) {
+    size_t start = 0;
+    for (size_t newline; (newline = window.find('\n', start)) !=
+                         std::string_view::npos;
+         start = newline + 1)
+      line(window.substr(start, newline - start));
+    keep = window.size() - start;
+  }
+  if (keep)
+    line(window.substr(window.size() - keep));
+}
+
+// Belady's MIN replacement on one access stream (--belady), the bound no
+// policy can beat at the same geometry. The accesses are kept as they are
+// replayed; a backward pass then finds the next use of each one, and a
+// forward pass evicts from each set the line whose next use is farthest,
+// taken from an ordered set of (next use, line) per cache set. Stores that
+// do not allocate are looked up but never fill, as in the modeled cache.
+class BeladyMin {
+public:
+  BeladyMin(const CacheGeometry &geometry, WritePolicy write)
+      : geometry(geometry), write(write) {}
+
+  void add(uint32_t address, AccessKind kind) {
+    lines.push_back(address >> geometry.offsetBits);
+    fills.push_back(kind != AccessKind::STORE ||
+                    write.miss == WriteMiss::ALLOCATE);
+  }
+
+  void print(TraceWriter &output, std::string_view cache) const {
+    const uint64_t hits = simulate();
+    writeCacheLabel(output, cache, "policy=min");
+    output << "hit="
+           << fixed_format(lines.empty() ? 0.0
+                                         : static_cast<double>(hits) /
+                                               lines.size(),
+                           4)
+           << '\n';
+  }
+
+private:
+  static constexpr uint64_t NEVER = UINT64_MAX;
+
+  CacheGeometry geometry;
+  WritePolicy write;
+  // Line number (address >> offsetBits) of every access, and whether it
+  // fills on a miss.
+  std::vector<uint32_t> lines;
+  std::vector<bool> fills;
+
+  // Returns the hits.
+  uint64_t simulate() const {
+    std::vector<uint64_t> nextUse(lines.size());
+    std::unordered_map<uint32_t, uint64_t> upcoming;
+    for (size_t i = lines.size(); i-- > 0;) {
+      const auto found = upcoming.try_emplace(lines[i], NEVER);
+      nextUse[i] = found.first->second;
+      found.first->second = i;
+    }
+
+    std::vector<std::set<std::pair<uint64_t, uint32_t>>> sets(geometry.sets);
+    // Next use of each resident line, its key in the set it is in.
+    std::unordered_map<uint32_t, uint64_t> resident;
+    uint64_t hits = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+      const uint32_t line = lines[i];
+      auto &set = sets[line & (geometry.sets - 1)];
+      const auto found = resident.find(line);
+      if (found != resident.end()) {
+        hits++;
+        set.erase({found->second, line});
+        set.insert({nextUse[i], line});
+        found->second = nextUse[i];
+        continue;
+      }
+      if (!fills[i])
+        continue;
+      if (set.size() == geometry.ways) {
+        const auto farthest = std::prev(set.end());
+        resident.erase(farthest->second);
+        set.erase(farthest);
+      }
+      set.insert({nextUse[i], line});
+      resident.emplace(line, nextUse[i]);
+    }
+    return hits;
+  }
+};
+
+class ReplayOptions {
+public:
+  CacheGeometry iCache = DEFAULT_CACHE;
+  CacheGeometry dCache = DEFAULT_CACHE;
+  std::string iPolicy = LruPolicy::NAME;
+  std::string dPolicy = LruPolicy::NAME;
+  WritePolicy dWrite;
+  std::vector<LevelOption> levels;
+  uint64_t policySeed = 1;
+  bool cacheTraffic = false;
+  bool missClasses = false;
+  uint32_t reuseLine = 0;
+  bool belady = false;
+  bool perf = false;
+  std::string explore;
+  unsigned exploreThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  ReplayOptions(int argc, char *argv[]) {
+    for (int i = 3; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--icache=", 0) == 0) {
+        parse(arg, 9, iCache, iPolicy);
+      } else if (arg.rfind("--dcache=", 0) == 0) {
+        parse(arg, 9, dCache, dPolicy);
+      } else if (arg == "--dcache-write=through") {
+        dWrite.hit = WriteHit::THROUGH;
+      } else if (arg == "--dcache-write=back") {
+        dWrite.hit = WriteHit::BACK;
+      } else if (arg == "--dcache-write-miss=allocate") {
+        dWrite.miss = WriteMiss::ALLOCATE;
+      } else if (arg == "--dcache-write-miss=no-allocate") {
+        dWrite.miss = WriteMiss::NO_ALLOCATE;
+      } else if (arg.rfind("--l2=", 0) == 0 && levels.empty()) {
+        levels.emplace_back();
+        parse(arg, 5, levels.back().geometry, levels.back().policy);
+      } else if (arg.rfind("--l3=", 0) == 0 && levels.size() == 1) {
+        levels.emplace_back();
+        parse(arg, 5, levels.back().geometry, levels.back().policy);
+      } else if (arg == "--cache-traffic") {
+        cacheTraffic = true;
+      } else if (arg == "--miss-classes") {
+        missClasses = true;
+      } else if (arg == "--reuse-distance") {
+        reuseLine = DEFAULT_CACHE.lineBytes;
+      } else if (arg.rfind("--reuse-distance=", 0) == 0) {
+        reuseLine = optionNumber<uint32_t>(arg, 17);
+        if (!CacheGeometry::powerOfTwo(reuseLine)) {
+          std::cerr << "FATAL: --reuse-distance needs a power-of-two line "
+                       "size in bytes"
+                    << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      } else if (arg == "--belady") {
+        belady = true;
+      } else if (arg == "--perf") {
+        perf = true;
+      } else if (arg.rfind("--policy-seed=", 0) == 0) {
+        policySeed = optionNumber<uint64_t>(arg, 14, std::string::npos, 0);
+      } else if (arg.rfind("--explore=", 0) == 0) {
+        explore = arg.substr(10);
+      } else if (arg.rfind("--explore-threads=", 0) == 0) {
+        exploreThreads = std::max(1u, optionNumber<unsigned>(arg, 18));
+      } else {
+        std::cerr << "Unknown option: " << arg
+                  << " (see the top of cachereplay.cpp; --l3 needs --l2 "
+                     "before it)"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+private:
+  static void parse(const std::string &arg, size_t prefix,
+                    CacheGeometry &geometry, std::string &policy) {
+    if (!parseCacheSpec(arg.substr(prefix), geometry, policy)) {
+      std::cerr << "FATAL: " << arg.substr(0, prefix - 1)
+                << " needs SETS:WAYS:LINE[:POLICY] with power-of-two sets "
+                   "and line bytes"
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+};
+
+std::unique_ptr<CacheLevel> makeLevel(const std::string &name,
+                                      const CacheGeometry &geometry,
+                                      const std::string &policy,
+                                      WritePolicy write, uint64_t seed) {
+  std::unique_ptr<CacheLevel> level =
+      makeCacheLevel(name, geometry, policy, write, seed);
+  if (!level) {
+    std::cerr << "FATAL: unknown replacement policy " << policy
+              << " (lru, plru, fifo, random, srrip or brrip)" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return level;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <trace> <output_file> [options]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  const ReplayOptions options(argc, argv);
+  Files files(argv[2]);
+
+  std::unique_ptr<CacheLevel> iCache =
+      makeLevel("i", options.iCache, options.iPolicy, WritePolicy(),
+                options.policySeed);
+  std::unique_ptr<CacheLevel> dCache =
+      makeLevel("d", options.dCache, options.dPolicy, options.dWrite,
+                options.policySeed);
+  std::vector<std::unique_ptr<CacheLevel>> levels;
+  for (size_t i = 0; i < options.levels.size(); ++i) {
+    const LevelOption &level = options.levels[i];
+    levels.push_back(makeLevel("l" + std::to_string(i + 2), level.geometry,
+                               level.policy, LevelOption::WRITE,
+                               options.policySeed));
+    if (i == 0) {
+      iCache->connect(levels[0].get());
+      dCache->connect(levels[0].get());
+    } else {
+      levels[i - 1]->connect(levels[i].get());
+    }
+  }
+  if (options.missClasses) {
+    iCache->classifyMisses();
+    dCache->classifyMisses();
+    for (const auto &level : levels)
+      level->classifyMisses();
+  }
+  std::unique_ptr<ReuseDistance> iReuse, dReuse;
+  if (options.reuseLine) {
+    iReuse.reset(new ReuseDistance(options.reuseLine));
+    dReuse.reset(new ReuseDistance(options.reuseLine));
+  }
+  std::unique_ptr<BeladyMin> iMin, dMin;
+  if (options.belady) {
+    iMin.reset(new BeladyMin(options.iCache, WritePolicy()));
+    dMin.reset(new BeladyMin(options.dCache, options.dWrite));
+  }
+  std::unique_ptr<CacheExplorer> explorer;
+  if (!options.explore.empty())
+    explorer.reset(new CacheExplorer(CacheExplorer::load(options.explore),
+                                     options.exploreThreads,
+                                     options.policySeed));
+
+  uint64_t accesses = 0;
+  auto visit = [&](uint32_t address, uint32_t size, uint8_t label) {
+    const AccessKind kind = dineroKind(label);
+    if (kind == AccessKind::FETCH) {
+      iCache->access(address, size, kind);
+      if (iReuse)
+        iReuse->add(address, size, kind);
+      if (iMin)
+        iMin->add(address, kind);
+    } else {
+      dCache->access(address, size, kind);
+      if (dReuse)
+        dReuse->add(address, size, kind);
+      if (dMin)
+        dMin->add(address, kind);
+    }
+    if (explorer)
+      explorer->add(address, size, kind);
+    accesses++;
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  TraceSource trace(argv[1]);
+  const std::string_view head = trace.head();
+  if (head.size() >= 8 &&
+      std::memcmp(head.data(), AccessTraceHeader::MAGIC, 8) == 0)
+    readBinary(trace, visit);
+  else
+    readDin(trace, visit);
+  if (explorer)
+    explorer->finish();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  dCache->printStats(files.output);
+  if (dMin)
+    dMin->print(files.output, "d");
+  iCache->printStats(files.output);
+  if (iMin)
+    iMin->print(files.output, "i");
+  for (const auto &level : levels)
+    level->printStats(files.output);
+  if (options.cacheTraffic || !levels.empty()) {
+    dCache->printTraffic(files.output);
+    iCache->printTraffic(files.output);
+    for (const auto &level : levels)
+      level->printTraffic(files.output);
+  }
+  if (dReuse) {
+    dReuse->print(files.output, "d");
+    iReuse->print(files.output, "i");
+  }
+  if (explorer)
+    explorer->print(files.output);
+  if (options.perf) {
+    std::cerr << accesses << " accesses in " << elapsed.count() << " s ("
+              << accesses / elapsed.count() / 1e6 << " M accesses/s)"
+              << std::endl;
+  }
+  return 0;
+}
@@ -1,12 +1,34 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 namespace MemoryMap {
 constexpr uint32_t OFFSET = 0x80000000;
 constexpr uint32_t CLINT_BASE = 0x02000000;
@@ -21,19 +43,450 @@ constexpr uint32_t PLIC_ENABLE = PLIC_BASE + 0x2000;
 constexpr uint32_t PLIC_THRESHOLD = 0x0c200000;
 constexpr uint32_t PLIC_CLAIM = 0x0c200004;
 constexpr uint32_t UART_IRQ = 10;
+constexpr uint32_t RAM_SIZE = 32 * 1024;
 } // namespace MemoryMap
 
+// Hex field of at least `width` digits (more if the value needs them),
+// printed as 0x-prefixed lowercase hex. Formatting it does not allocate.
+class HexField {
+public:
+  uint32_t value;
+  int width;
+};
+
+constexpr HexField hex_format(uint32_t val, int width) { return {val, width}; }
+
+// Decimal value with a fixed number of fractional digits, for the summary
+// lines only.
+class FixedField {
+public:
+  double value;
+  int precision;
+};
+
+constexpr FixedField fixed_format(double val, int precision) {
+  return {val, precision};
+}
+
+// "00".."ff" and "00".."99" as character pairs, so hex and decimal numbers
+// are written two digits per lookup.
+constexpr std::array<char, 512> HEX_PAIRS = [] {
+  std::array<char, 512> table = {};
+  constexpr char digits[] = "0123456789abcdef";
+  for (int i = 0; i < 256; ++i) {
+    table[2 * i] = digits[i >> 4];
+    table[2 * i + 1] = digits[i & 0xF];
+  }
+  return table;
+}();
+
+constexpr std::array<char, 200> DECIMAL_PAIRS = [] {
+  std::array<char, 200> table = {};
+  for (int i = 0; i < 100; ++i) {
+    table[2 * i] = static_cast<char>('0' + i / 10);
+    table[2 * i + 1] = static_cast<char>('0' + i % 10);
+  }
+  return table;
+}();
+
+// Single-producer/single-consumer byte ring. Only the producer stores `head`
+// and only the consumer stores `tail`; both count bytes since creation, so
+// their difference is the fill level and no lock is needed.
+class ByteRing {
+private:
+  std::unique_ptr<char[]> data;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+public:
+  explicit ByteRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    data.reset(new char[size]);
+    mask = size - 1;
+  }
+
+  size_t space() const {
+    return mask + 1 - (head.load(std::memory_order_relaxed) -
+                       tail.load(std::memory_order_acquire));
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+  // Producer: copies as much of `bytes` as fits and returns how much that was.
+  size_t push(const char *bytes, size_t size) {
+    const size_t at = head.load(std::memory_order_relaxed);
+    size = std::min(size, space());
+    const size_t first = std::min(size, mask + 1 - (at & mask));
+    std::memcpy(data.get() + (at & mask), bytes, first);
+    std::memcpy(data.get(), bytes + first, size - first);
+    head.store(at + size, std::memory_order_release);
+    return size;
+  }
+
+  // Consumer: the longest contiguous run of unread bytes.
+  std::pair<const char *, size_t> peek() const {
+    const size_t at = tail.load(std::memory_order_relaxed);
+    const size_t available = head.load(std::memory_order_acquire) - at;
+    return {data.get() + (at & mask),
+            std::min(available, mask + 1 - (at & mask))};
+  }
+
+  void consume(size_t size) {
+    tail.store(tail.load(std::memory_order_relaxed) + size,
+               std::memory_order_release);
+  }
+};
+
+// What an asynchronous writer does with a block that does not fit in its
+// ring: wait for the writer thread, or drop the block and count its lines.
+enum class RingFull { WAIT, DROP };
+
+void writeAll(int fd, const char *bytes, size_t size) {
+  while (size > 0) {
+    const ssize_t written = ::write(fd, bytes, size);
+    if (written <= 0)
+      return;
+    bytes += written;
+    size -= written;
+  }
+}
+
+// Buffered writer for the trace file. Text is formatted straight into one
+// buffer allocated when the file is opened, and handed on in blocks of whole
+// lines: to write(2) directly, or after makeAsync() to a ring drained by a
+// WriterThread. After makeMapped() the buffer is instead a shared mapping of
+// the file itself, grown in MAP_CHUNK steps and truncated to the text at
+// flush() and close(). A writer belongs to the thread that formats into it
+// and is never shared.
+class TraceWriter {
+private:
+  static constexpr size_t CAPACITY = 1 << 20;
+  static constexpr size_t BLOCK = 64 * 1024;
+  static constexpr size_t MAP_CHUNK = 16 << 20;
+
+  std::unique_ptr<char[]> buffer;
+  char *data = nullptr;
+  size_t capacity = CAPACITY;
+  size_t handOffAt = BLOCK;
+  size_t used = 0;
+  uint64_t pendingLines = 0;
+  int fd = -1;
+  std::unique_ptr<ByteRing> ring;
+  RingFull whenFull = RingFull::WAIT;
+  size_t mappedSize = 0;
+  std::string *sink = nullptr;
+
+  char *reserve(size_t size) {
+    if (capacity - used < size)
+      handOff(false, size);
+    return data + used;
+  }
+
+  void handOff(bool mayDrop, size_t needed = 1) {
+    if (mappedSize) {
+      growMapping(needed);
+      return;
+    }
+    if (sink) {
+      sink->append(data, used);
+    } else if (!ring) {
+      writeAll(fd, data, used);
+    } else if (mayDrop && whenFull == RingFull::DROP && ring->space() < used) {
+      droppedLines += pendingLines;
+    } else {
+      for (size_t done = 0;;) {
+        done += ring->push(data + done, used - done);
+        if (done == used)
+          break;
+        std::this_thread::yield();
+      }
+    }
+    used = 0;
+    pendingLines = 0;
+  }
+
+  // Makes room for `needed` more bytes: extends the file (allocating the
+  // blocks, so a full disk fails here rather than as SIGBUS on a store) and
+  // the mapping by whole chunks.
+  void growMapping(size_t needed) {
+    if (used + needed > mappedSize) {
+      const size_t size =
+          (used + needed + MAP_CHUNK - 1) / MAP_CHUNK * MAP_CHUNK;
+      void *grown = mremap(data, mappedSize, size, MREMAP_MAYMOVE);
+      if (grown == MAP_FAILED) {
+        std::cerr << "FATAL: mremap of the output failed." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      data = static_cast<char *>(grown);
+      mappedSize = size;
+    }
+    if (posix_fallocate(fd, 0, mappedSize) != 0) {
+      std::cerr << "FATAL: Failed to extend the output file." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    capacity = mappedSize;
+  }
+
+  TraceWriter &decimal(uint64_t value, bool negative) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    while (value >= 100) {
+      start -= 2;
+      std::memcpy(start, &DECIMAL_PAIRS[2 * (value % 100)], 2);
+      value /= 100;
+    }
+    if (value >= 10) {
+      start -= 2;
+      std::memcpy(start, &DECIMAL_PAIRS[2 * value], 2);
+    } else {
+      *--start = static_cast<char>('0' + value);
+    }
+    if (negative)
+      *--start = '-';
+    return write(start, end - start);
+  }
+
+public:
+  uint64_t lines = 0;
+  uint64_t droppedLines = 0;
+
+  TraceWriter() = default;
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+  ~TraceWriter() { close(); }
+
+  bool open(const char *path) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      buffer.reset(new char[CAPACITY]);
+      data = buffer.get();
+    }
+    return fd >= 0;
+  }
+
+  bool is_open() const { return fd >= 0 || sink; }
+
+  // Collects the text in `text` instead of writing a file.
+  void captureTo(std::string &text) {
+    buffer.reset(new char[CAPACITY]);
+    data = buffer.get();
+    sink = &text;
+  }
+
+  // From now on blocks go through a ring of `capacity` bytes (at least twice
+  // the block size). Call before the draining WriterThread starts.
+  void makeAsync(size_t capacity, RingFull policy) {
+    ring.reset(new ByteRing(std::max(capacity, 2 * BLOCK)));
+    whenFull = policy;
+  }
+
+  // From now on text is formatted into a mapping of the file. Returns false,
+  // leaving the writer buffered, for files that cannot be mapped such as
+  // pipes and /dev/null. Call before anything is written.
+  bool makeMapped() {
+    if (posix_fallocate(fd, 0, MAP_CHUNK) != 0)
+      return false;
+    void *mapping = mmap(nullptr, MAP_CHUNK, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      ftruncate(fd, 0);
+      return false;
+    }
+    buffer.reset();
+    data = static_cast<char *>(mapping);
+    mappedSize = capacity = MAP_CHUNK;
+    handOffAt = SIZE_MAX;
+    return true;
+  }
+
+  // Returns only once everything written so far has reached the file. A
+  // mapped file is cut to the text written so far; the next write extends
+  // it again.
+  void flush() {
+    if (mappedSize) {
+      ftruncate(fd, used);
+      capacity = used;
+      return;
+    }
+    handOff(false);
+    while (ring && !ring->empty())
+      std::this_thread::yield();
+  }
+
+  void close() {
+    if (fd < 0)
+      return;
+    flush();
+    if (mappedSize) {
+      munmap(data, mappedSize);
+      mappedSize = 0;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+
+  // Writer thread side: writes out what the ring holds. Returns false when it
+  // was empty.
+  bool drain() {
+    const auto bytes = ring->peek();
+    if (bytes.second == 0)
+      return false;
+    writeAll(fd, bytes.first, bytes.second);
+    ring->consume(bytes.second);
+    return true;
+  }
+
+  TraceWriter &write(const char *text, size_t size) {
+    while (size > 0) {
+      const size_t part = std::min(size, capacity - used);
+      if (part == 0) {
+        handOff(false, size);
+        continue;
+      }
+      std::memcpy(data + used, text, part);
+      used += part;
+      text += part;
+      size -= part;
+    }
+    return *this;
+  }
+
+  // String literals: the length is known at compile time.
+  template <size_t N> TraceWriter &operator<<(const char (&text)[N]) {
+    return write(text, N - 1);
+  }
+
+  TraceWriter &operator<<(std::string_view text) {
+    return write(text.data(), text.size());
+  }
+
+  // Text of `count` whole lines formatted by another writer.
+  void writeFormatted(const std::string &text, uint64_t count) {
+    write(text.data(), text.size());
+    lines += count;
+    pendingLines += count;
+  }
+
+  TraceWriter &operator<<(char c) {
+    *reserve(1) = c;
+    used++;
+    if (c == '\n') {
+      lines++;
+      pendingLines++;
+      if (used >= handOffAt)
+        handOff(true);
+    }
+    return *this;
+  }
+
+  TraceWriter &operator<<(int32_t value) {
+    return decimal(value < 0 ? -static_cast<int64_t>(value) : value,
+                   value < 0);
+  }
+  TraceWriter &operator<<(uint32_t value) { return decimal(value, false); }
+  TraceWriter &operator<<(uint64_t value) { return decimal(value, false); }
+
+  TraceWriter &operator<<(HexField field) {
+    char digits[8];
+    for (int i = 0; i < 4; ++i) {
+      const uint32_t byte = (field.value >> (24 - 8 * i)) & 0xFF;
+      std::memcpy(&digits[2 * i], &HEX_PAIRS[2 * byte], 2);
+    }
+    const int significant =
+        field.value ? (35 - __builtin_clz(field.value)) / 4 : 1;
+    const int zeros = field.width > significant ? field.width - significant : 0;
+    char *out = reserve(2 + zeros + significant);
+    out[0] = '0';
+    out[1] = 'x';
+    std::memset(out + 2, '0', zeros);
+    std::memcpy(out + 2 + zeros, digits + 8 - significant, significant);
+    used += 2 + zeros + significant;
+    return *this;
+  }
+
+  TraceWriter &operator<<(FixedField field) {
+    char text[64];
+    const int size =
+        snprintf(text, sizeof(text), "%.*f", field.precision, field.value);
+    return write(text, size);
+  }
+};
+
+std::ostream &operator<<(std::ostream &out, HexField field) {
+  const char *const digits = "0123456789abcdef";
+  char text[10];
+  int size = 0;
+  for (uint32_t value = field.value; value || size == 0; value >>= 4)
+    text[size++] = digits[value & 0xF];
+  out << "0x";
+  for (int i = size; i < field.width; ++i)
+    out << '0';
+  while (size > 0)
+    out << text[--size];
+  return out;
+}
+
+// Drains the rings of asynchronous TraceWriters on a dedicated thread, so the
+// emulator thread never waits on file I/O unless a ring is full.
+class WriterThread {
+private:
+  std::vector<TraceWriter *> writers;
+  std::atomic<bool> stopping{false};
+  std::thread thread;
+
+  void loop() {
+    for (;;) {
+      bool busy = false;
+      for (TraceWriter *writer : writers)
+        busy |= writer->drain();
+      if (busy)
+        continue;
+      if (stopping.load(std::memory_order_acquire))
+        return;
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+public:
+  ~WriterThread() { stop(); }
+
+  void start(const std::vector<TraceWriter *> &drained) {
+    writers = drained;
+    thread = std::thread(&WriterThread::loop, this);
+  }
+
+  // Drains whatever is still queued and joins the thread.
+  void stop() {
+    if (!thread.joinable())
+      return;
+    stopping.store(true, std::memory_order_release);
+    thread.join();
+  }
+};
+
 class Files {
+private:
+  WriterThread writerThread;
+
 public:
   std::ifstream input;
-  std::ofstream output;
+  TraceWriter output;
   std::ifstream terminalInput;
-  std::ofstream terminalOutput;
+  TraceWriter terminalOutput;
 
   Files(int argc, char *argv[]) {
     if (argc < 5) {
       std::cerr << "Usage: " << argv[0]
                 << " <input_file> <output_file> <terminal_in> <terminal_out>"
+                << std::endl
+                << "       " << argv[0] << " --translate <input_file> <out.cpp>"
                 << std::endl;
       exit(EXIT_FAILURE);
     }
@@ -49,6 +502,22 @@ public:
     }
   }
 
+  // Output kept in memory, for replays that format part of a trace.
+  Files(std::string &text, std::string &terminal) {
+    output.captureTo(text);
+    terminalOutput.captureTo(terminal);
+  }
+
+  // Output only, for tools that replay a trace instead of loading a program.
+  explicit Files(const char *outputPath) {
+    output.open(outputPath);
+    terminalOutput.open("/dev/null");
+    if (!output.is_open()) {
+      std::cerr << "FATAL: Failed to open " << outputPath << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
   ~Files() {
     if (input.is_open())
       input.close();
@@ -58,247 +527,2299 @@ public:
       terminalInput.close();
     if (terminalOutput.is_open())
       terminalOutput.close();
+    writerThread.stop();
+  }
+
+  // Moves trace and terminal output to rings drained by a writer thread. Only
+  // the trace may drop blocks; terminal output always waits.
+  void startAsync(size_t capacity, RingFull policy) {
+    output.makeAsync(capacity, policy);
+    terminalOutput.makeAsync(capacity, RingFull::WAIT);
+    writerThread.start({&output, &terminalOutput});
+  }
+
+  // Formats trace and terminal output straight into mappings of the files;
+  // either one that cannot be mapped stays buffered.
+  void startMapped() {
+    output.makeMapped();
+    terminalOutput.makeMapped();
+  }
+
+  void flush() {
+    output.flush();
+    terminalOutput.flush();
   }
 };
 
-std::string hex_format(uint32_t val, int width) {
-  std::stringstream ss;
-  ss << "0x" << std::hex << std::setw(width) << std::setfill('0') << val;
-  return ss.str();
-}
+// Trace policies select which parts of the output file a run produces. The
+// caches and the execution engines are instantiated once per policy, so the
+// formatting for output a policy turns off is compiled out, not skipped.
+enum class TraceMode : uint8_t { FULL, CACHE, STATS, NONE, BINARY };
 
-class CacheLine {
+template <TraceMode M> class TracePolicy {
 public:
-  bool isValid = false;
-  uint32_t tag = 0;
-  std::array<uint32_t, 4> block;
-  uint8_t lruCounter = 0;
+  static constexpr TraceMode MODE = M;
+  static constexpr bool INSTRUCTIONS = M == TraceMode::FULL;
+  static constexpr bool CACHE_EVENTS =
+      M == TraceMode::FULL || M == TraceMode::CACHE;
+  static constexpr bool STATS =
+      M != TraceMode::NONE && M != TraceMode::BINARY;
+  static constexpr bool RECORDS = M == TraceMode::BINARY;
 };
 
-class Cache {
-private:
-  std::vector<std::vector<CacheLine>> sets;
-  const unsigned int numSets = 8;
-  const unsigned int associativity = 2;
-  uint64_t hits = 0;
-  uint64_t misses = 0;
-  std::string cacheType;
-  std::ofstream &output;
+using FullTrace = TracePolicy<TraceMode::FULL>;
+using CacheTrace = TracePolicy<TraceMode::CACHE>;
+using StatsTrace = TracePolicy<TraceMode::STATS>;
+using NoTrace = TracePolicy<TraceMode::NONE>;
+using BinaryTrace = TracePolicy<TraceMode::BINARY>;
 
-  unsigned int findLRU(unsigned int setIndex) {
-    if (!sets[setIndex][0].isValid)
-      return 0;
-    if (!sets[setIndex][1].isValid)
-      return 1;
-    return (sets[setIndex][0].lruCounter > sets[setIndex][1].lruCounter) ? 0
-                                                                         : 1;
-  }
+// Binary trace (--trace=binary): a TraceHeader, the initial memory image and
+// then one TraceRecord per event. tracerender turns it back into the text
+// trace by replaying the image against the records, on caches built from the
+// geometry and write policy in the header.
+class TraceHeader {
+public:
+  static constexpr char MAGIC[8] = {'P', 'O', 'X', 'I', 'M', 'B', 'T', '2'};
+  static constexpr char PACKED_MAGIC[8] = {'P', 'O', 'X', 'I',
+                                           'M', 'P', 'T', '2'};
 
-  void updateLRU(unsigned int setIndex, unsigned int accessedWay) {
-    sets[setIndex][accessedWay].lruCounter = 0;
-    sets[setIndex][1 - accessedWay].lruCounter++;
-  }
+  char magic[8];
+  uint32_t recordSize;
+  uint32_t memoryBase;
+  uint32_t memorySize;
+  // SETS, WAYS and LINE bytes of each cache.
+  std::array<uint32_t, 3> iCache;
+  std::array<uint32_t, 3> dCache;
+  // The d-cache's WriteHit and WriteMiss.
+  uint8_t dWriteHit;
+  uint8_t dWriteMiss;
+  uint8_t reserved[2];
+};
 
+enum class RecordKind : uint8_t {
+  INSTRUCTION,
+  EXCEPTION,
+  INTERRUPT,
+  FETCH_FAULT
+};
+
+// One event of the binary trace. For an INSTRUCTION `value` is rd after it
+// retired and `address` the effective address of a load or store. For the
+// trap kinds they hold mcause and mtval, and `raw` is 0 unless an
+// instruction raised it. `iCache`/`dCache` are Cache::lastAccess values.
+class TraceRecord {
 public:
-  Cache(const std::string &name, std::ofstream &out)
-      : cacheType(name), output(out) {
-    sets.resize(numSets, std::vector<CacheLine>(associativity));
-  }
+  uint32_t pc;
+  uint32_t raw;
+  uint32_t value;
+  uint32_t address;
+  uint32_t nextPc;
+  uint32_t iCache;
+  uint32_t dCache;
+  RecordKind kind;
+  uint8_t reserved[3];
+};
 
-  uint32_t read(uint32_t address, std::vector<uint8_t> &mem) {
-    uint32_t offset = (address & 0xF) >> 2;
-    uint32_t index = (address >> 4) & 0x7;
-    uint32_t tag = address >> 7;
-
-    for (unsigned int i = 0; i < associativity; ++i) {
-      if (sets[index][i].isValid && sets[index][i].tag == tag) {
-        hits++;
-        output << "#cache_mem:" << cacheType << "rh " << hex_format(address, 8)
-               << "       line=" << index
-               << ",age=" << static_cast<int>(sets[index][i].lruCounter)
-               << ",id=0x" << std::hex << std::setw(6) << std::setfill('0')
-               << tag << ",block[" << i << "]={"
-               << hex_format(sets[index][i].block[0], 8) << ","
-               << hex_format(sets[index][i].block[1], 8) << ","
-               << hex_format(sets[index][i].block[2], 8) << ","
-               << hex_format(sets[index][i].block[3], 8) << "}" << std::dec
-               << std::endl;
-        updateLRU(index, i);
-        return sets[index][i].block[offset];
-      }
-    }
+static_assert(sizeof(TraceRecord) == 32, "records are 32 bytes on disk");
 
-    misses++;
-    unsigned int victimWay = findLRU(index);
-    CacheLine &victimLine = sets[index][victimWay];
-    output << "#cache_mem:" << cacheType << "rm " << hex_format(address, 8)
-           << "       line=" << index << ",valid={" << sets[index][0].isValid
-           << "," << sets[index][1].isValid << "},age={"
-           << static_cast<int>(sets[index][1].lruCounter) << ","
-           << static_cast<int>(sets[index][0].lruCounter) << "},id={0x"
-           << std::hex << std::setw(6) << std::setfill('0')
-           << sets[index][0].tag << ",0x" << std::setw(6) << std::setfill('0')
-           << sets[index][1].tag << "}" << std::dec << std::endl;
-
-    victimLine.isValid = true;
-    victimLine.tag = tag;
-    uint32_t blockStartAddr = address & ~0xF;
-    for (int i = 0; i < 4; ++i) {
-      uint32_t memAddr = blockStartAddr + (i * 4);
-      uint32_t memIndex = memAddr - MemoryMap::OFFSET;
-      if (memIndex + 3 < mem.size()) {
-        victimLine.block[i] =
-            (mem[memIndex + 0] << 0) | (mem[memIndex + 1] << 8) |
-            (mem[memIndex + 2] << 16) | (mem[memIndex + 3] << 24);
-      }
+// Packed trace (--trace=packed): the same records, compressed without any
+// external library. The TraceHeader (magic PACKED_MAGIC) and the memory image
+// are followed by blocks of at most BLOCK_RECORDS records, each a PackedBlock
+// and its payload. The file ends with one PackedIndexEntry per block and a
+// PackedTrailer, so a reader can seek to instruction N by decoding a single
+// block.
+class PackedBlock {
+public:
+  static constexpr uint32_t BLOCK_RECORDS = 4096;
+
+  uint32_t payloadSize;
+  uint32_t records;
+};
+
+// `instruction` counts the INSTRUCTION and EXCEPTION records before the block.
+class PackedIndexEntry {
+public:
+  uint64_t instruction;
+  uint64_t offset;
+};
+
+class PackedTrailer {
+public:
+  static constexpr char MAGIC[8] = {'P', 'O', 'X', 'I', 'M', 'I', 'D', 'X'};
+
+  uint64_t indexOffset;
+  uint64_t blocks;
+  uint64_t instructions;
+  char magic[8];
+};
+
+constexpr bool isInstruction(RecordKind kind) {
+  return kind == RecordKind::INSTRUCTION || kind == RecordKind::EXCEPTION;
+}
+
+// Encodes records as a flags byte plus only what the previous records do not
+// predict. The pc is implied by the previous nextPc, nextPc by pc + 4 and the
+// instruction word by a dictionary of the words last seen at each pc slot.
+// Deltas and values are zigzag LEB128 varints. One codec encodes or decodes a
+// single block, so every block starts from a fresh one.
+class TraceCodec {
+public:
+  void encode(const TraceRecord &record, std::vector<uint8_t> &out) {
+    uint32_t &word = dictionary[slot(record.pc)];
+    uint8_t flags = 0;
+    if (record.kind != RecordKind::INSTRUCTION)
+      flags |= KIND;
+    if (record.pc != expectedPc)
+      flags |= PC;
+    if (record.nextPc != record.pc + 4)
+      flags |= NEXT_PC;
+    if (record.raw != word)
+      flags |= record.raw == 0 ? RAW_ZERO : RAW_LITERAL;
+    if (record.value != 0)
+      flags |= VALUE;
+    if (record.address != 0)
+      flags |= ADDRESS;
+    if (record.iCache != iCache || record.dCache != dCache)
+      flags |= CACHES;
+
+    out.push_back(flags);
+    if (flags & KIND)
+      out.push_back(static_cast<uint8_t>(record.kind));
+    if (flags & PC)
+      putSigned(out, record.pc - expectedPc);
+    if (flags & RAW_LITERAL) {
+      for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<uint8_t>(record.raw >> (8 * i)));
+      word = record.raw;
+    }
+    if (flags & NEXT_PC)
+      putSigned(out, record.nextPc - record.pc - 4);
+    if (flags & VALUE)
+      putSigned(out, record.value);
+    if (flags & ADDRESS)
+      putSigned(out, record.address - lastAddress);
+    if (flags & CACHES) {
+      putSigned(out, record.iCache - iCache);
+      putSigned(out, record.dCache - dCache);
     }
-    updateLRU(index, victimWay);
-    return victimLine.block[offset];
+    advance(record);
   }
 
-  void write(uint32_t address, uint32_t data, uint8_t funct3,
-             std::vector<uint8_t> &mem) {
-    uint32_t offset = (address & 0xF) >> 2;
-    uint32_t index = (address >> 4) & 0x7;
-    uint32_t tag = address >> 7;
-    uint32_t byte_offset = address & 0x3;
-
-    for (unsigned int i = 0; i < associativity; ++i) {
-      if (sets[index][i].isValid && sets[index][i].tag == tag) {
-        hits++;
-        output << "#cache_mem:" << cacheType << "wh " << hex_format(address, 8)
-               << "       line=" << index
-               << ",age=" << static_cast<int>(sets[index][i].lruCounter)
-               << ",id=0x" << std::hex << std::setw(6) << std::setfill('0')
-               << tag << ",block[" << i << "]={"
-               << hex_format(sets[index][i].block[0], 8) << ","
-               << hex_format(sets[index][i].block[1], 8) << ","
-               << hex_format(sets[index][i].block[2], 8) << ","
-               << hex_format(sets[index][i].block[3], 8) << "}" << std::dec
-               << std::endl;
-
-        uint32_t memIndex = address - MemoryMap::OFFSET;
-        if (funct3 == 0b000) {
-          uint32_t mask = ~(0xFF << (byte_offset * 8));
-          sets[index][i].block[offset] = (sets[index][i].block[offset] & mask) |
-                                         ((data & 0xFF) << (byte_offset * 8));
-          mem[memIndex] = data & 0xFF;
-        } else if (funct3 == 0b001) {
-          uint32_t mask = ~(0xFFFF << (byte_offset * 8));
-          sets[index][i].block[offset] = (sets[index][i].block[offset] & mask) |
-                                         ((data & 0xFFFF) << (byte_offset * 8));
-          mem[memIndex] = data & 0xFF;
-          mem[memIndex + 1] = (data >> 8) & 0xFF;
-        } else if (funct3 == 0b010) {
-          sets[index][i].block[offset] = data;
-          mem[memIndex] = data & 0xFF;
-          mem[memIndex + 1] = (data >> 8) & 0xFF;
-          mem[memIndex + 2] = (data >> 16) & 0xFF;
-          mem[memIndex + 3] = (data >> 24) & 0xFF;
-        }
-        updateLRU(index, i);
-        return;
-      }
+  // Returns false when the payload ends in the middle of a record.
+  bool decode(const uint8_t *&in, const uint8_t *end, TraceRecord &record) {
+    if (in == end)
+      return false;
+    const uint8_t flags = *in++;
+    record = {};
+    record.kind = RecordKind::INSTRUCTION;
+    record.pc = expectedPc;
+    if (flags & KIND) {
+      if (in == end)
+        return false;
+      record.kind = static_cast<RecordKind>(*in++);
+    }
+    if ((flags & PC) && !getSigned(in, end, record.pc))
+      return false;
+    uint32_t &word = dictionary[slot(record.pc)];
+    record.raw = word;
+    if (flags & RAW_ZERO)
+      record.raw = 0;
+    if (flags & RAW_LITERAL) {
+      if (end - in < 4)
+        return false;
+      record.raw = in[0] | in[1] << 8 | in[2] << 16 | uint32_t(in[3]) << 24;
+      in += 4;
+      word = record.raw;
     }
+    record.nextPc = record.pc + 4;
+    if ((flags & NEXT_PC) && !getSigned(in, end, record.nextPc))
+      return false;
+    if ((flags & VALUE) && !getSigned(in, end, record.value))
+      return false;
+    if (flags & ADDRESS) {
+      record.address = lastAddress;
+      if (!getSigned(in, end, record.address))
+        return false;
+    }
+    record.iCache = iCache;
+    record.dCache = dCache;
+    if ((flags & CACHES) && (!getSigned(in, end, record.iCache) ||
+                             !getSigned(in, end, record.dCache)))
+      return false;
+    advance(record);
+    return true;
+  }
 
-    misses++;
-    output << "#cache_mem:" << cacheType << "wm " << hex_format(address, 8)
-           << "       line=" << index << ",valid={" << sets[index][0].isValid
-           << "," << sets[index][1].isValid << "},age={"
-           << static_cast<int>(sets[index][1].lruCounter) << ","
-           << static_cast<int>(sets[index][0].lruCounter) << "},id={0x"
-           << std::hex << std::setw(6) << std::setfill('0')
-           << sets[index][0].tag << ",0x" << std::setw(6) << std::setfill('0')
-           << sets[index][1].tag << "}" << std::dec << std::endl;
+private:
+  enum Flags : uint8_t {
+    KIND = 1 << 0,
+    PC = 1 << 1,
+    NEXT_PC = 1 << 2,
+    RAW_LITERAL = 1 << 3,
+    RAW_ZERO = 1 << 4,
+    VALUE = 1 << 5,
+    ADDRESS = 1 << 6,
+    CACHES = 1 << 7
+  };
 
-    uint32_t memIndex = address - MemoryMap::OFFSET;
-    if (funct3 == 0b000) {
-      mem[memIndex] = data & 0xFF;
-    } else if (funct3 == 0b001) {
-      mem[memIndex] = data & 0xFF;
-      mem[memIndex + 1] = (data >> 8) & 0xFF;
-    } else if (funct3 == 0b010) {
-      mem[memIndex] = data & 0xFF;
-      mem[memIndex + 1] = (data >> 8) & 0xFF;
-      mem[memIndex + 2] = (data >> 16) & 0xFF;
-      mem[memIndex + 3] = (data >> 24) & 0xFF;
+  std::array<uint32_t, 1024> dictionary = {};
+  uint32_t expectedPc = 0;
+  uint32_t lastAddress = 0;
+  uint32_t iCache = 0;
+  uint32_t dCache = 0;
+
+  static size_t slot(uint32_t pc) { return (pc >> 2) % 1024; }
+
+  void advance(const TraceRecord &record) {
+    expectedPc = record.nextPc;
+    if (record.address != 0)
+      lastAddress = record.address;
+    iCache = record.iCache;
+    dCache = record.dCache;
+  }
+
+  static void putSigned(std::vector<uint8_t> &out, uint32_t value) {
+    const int32_t signedValue = static_cast<int32_t>(value);
+    uint32_t zigzag = (value << 1) ^ static_cast<uint32_t>(signedValue >> 31);
+    while (zigzag >= 0x80) {
+      out.push_back(static_cast<uint8_t>(zigzag | 0x80));
+      zigzag >>= 7;
     }
+    out.push_back(static_cast<uint8_t>(zigzag));
   }
 
-  void printStats() {
-    uint64_t totalAccesses = hits + misses;
-    double hitRate =
-        (totalAccesses == 0) ? 0.0 : static_cast<double>(hits) / totalAccesses;
-    output << "#cache_mem:" << cacheType
-           << "stats                hit=" << std::fixed << std::setprecision(4)
-           << hitRate << std::endl;
+  // Adds the decoded delta to `value`, wrapping at 32 bits.
+  static bool getSigned(const uint8_t *&in, const uint8_t *end,
+                        uint32_t &value) {
+    uint32_t zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (in == end)
+        return false;
+      const uint8_t byte = *in++;
+      zigzag |= static_cast<uint32_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        value += (zigzag >> 1) ^ -(zigzag & 1);
+        return true;
+      }
+    }
+    return false;
   }
 };
 
-void loadMemory(std::ifstream &input, uint32_t offset,
-                std::vector<uint8_t> &mem) {
-  std::string lineBuffer;
-  uint32_t currentAddress = 0;
-  input.clear();
-  input.seekg(0, std::ios::beg);
+// Groups records into blocks for the packed trace and writes the index when
+// the run ends. `offset` is the file position of the first block.
+class PackedTraceWriter {
+public:
+  PackedTraceWriter(TraceWriter &out, uint64_t offset)
+      : out(out), offset(offset) {}
 
-  while (std::getline(input, lineBuffer)) {
-    if (lineBuffer.empty())
-      continue;
+  void add(const TraceRecord &record) {
+    if (records == 0)
+      index.push_back({instructions, offset});
+    codec.encode(record, payload);
+    instructions += isInstruction(record.kind);
+    if (++records == PackedBlock::BLOCK_RECORDS)
+      endBlock();
+  }
 
-    if (lineBuffer[0] == '@') {
-      sscanf(lineBuffer.c_str(), "@%x", &currentAddress);
-    } else {
-      std::stringstream ss(lineBuffer);
-      unsigned int byteVal = 0;
-      while (ss >> std::hex >> byteVal) {
-        if (currentAddress >= offset) {
-          uint32_t memIndex = currentAddress - offset;
-          if (memIndex < mem.size()) {
-            mem[memIndex] = static_cast<uint8_t>(byteVal);
-          }
-        }
-        currentAddress++;
-      }
-    }
+  void finish() {
+    if (records > 0)
+      endBlock();
+    PackedTrailer trailer = {offset, index.size(), instructions, {}};
+    std::memcpy(trailer.magic, PackedTrailer::MAGIC, sizeof(trailer.magic));
+    out.write(reinterpret_cast<const char *>(index.data()),
+              index.size() * sizeof(PackedIndexEntry));
+    out.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
   }
-}
 
-int32_t signedImmediate(uint16_t imm) {
-  return (imm & 0x800) ? (0xFFFFF000 | imm) : imm;
-}
+private:
+  TraceWriter &out;
+  uint64_t offset;
+  TraceCodec codec;
+  std::vector<uint8_t> payload;
+  uint32_t records = 0;
+  uint64_t instructions = 0;
+  std::vector<PackedIndexEntry> index;
 
-void loadRd(uint32_t data, uint8_t rd, std::array<uint32_t, 32> &x) {
-  if (rd != 0) {
-    x[rd] = data;
+  void endBlock() {
+    const PackedBlock block = {static_cast<uint32_t>(payload.size()),
+                               records};
+    out.write(reinterpret_cast<const char *>(&block), sizeof(block));
+    out.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+    offset += sizeof(block) + payload.size();
+    payload.clear();
+    records = 0;
+    codec = TraceCodec();
   }
-}
+};
 
-void triggerException(uint32_t cause, uint32_t tval, uint32_t &pc,
-                      uint32_t &mepc, uint32_t &mcause, uint32_t &mtvec,
-                      uint32_t &mtval, uint32_t &mstatus) {
-  mepc = pc;
-  mcause = cause;
-  mtval = tval;
+// Sizes of a cache. Sets and line size are powers of two, so the word, index
+// and tag of an address are a mask and two shifts computed here once; for a
+// constexpr geometry such as DEFAULT_CACHE they are compile-time constants.
+class CacheGeometry {
+public:
+  static constexpr uint32_t MAX_WAYS = 64;
 
-  uint32_t mie = (mstatus >> 3) & 1;
-  mstatus &= ~(1 << 7);
-  mstatus |= (mie << 7);
-  mstatus &= ~(1 << 3);
-  mstatus &= ~(0b11 << 11);
-  mstatus |= (0b11 << 11);
+  uint32_t sets;
+  uint32_t ways;
+  uint32_t lineBytes;
+  unsigned offsetBits;
+  unsigned tagShift;
 
-  if ((mtvec & 0x1) && (cause & 0x80000000)) {
-    uint32_t base = mtvec & ~0x3;
-    uint32_t cause_num = cause & 0x7FFFFFFF;
-    pc = base + (4 * cause_num);
-  } else {
-    pc = mtvec & ~0x3;
+  constexpr CacheGeometry(uint32_t sets, uint32_t ways, uint32_t lineBytes)
+      : sets(sets), ways(ways), lineBytes(lineBytes),
+        offsetBits(log2(lineBytes)), tagShift(log2(lineBytes) + log2(sets)) {}
+
+  static constexpr unsigned log2(uint32_t value) {
+    unsigned bits = 0;
+    while (bits < 31 && (1u << bits) < value)
+      ++bits;
+    return bits;
   }
-}
 
-const char *getCsrName(uint16_t address) {
-  switch (address) {
+  static constexpr bool powerOfTwo(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+  }
+
+  constexpr bool valid() const {
+    return powerOfTwo(sets) && powerOfTwo(lineBytes) && lineBytes >= 4 &&
+           ways >= 1 && ways <= MAX_WAYS && tagShift < 32;
+  }
+
+  constexpr uint32_t wordsPerLine() const { return lineBytes / 4; }
+  constexpr uint32_t lines() const { return sets * ways; }
+
+  constexpr uint32_t word(uint32_t address) const {
+    return (address & (lineBytes - 1)) >> 2;
+  }
+  constexpr uint32_t index(uint32_t address) const {
+    return (address >> offsetBits) & (sets - 1);
+  }
+  constexpr uint32_t tag(uint32_t address) const { return address >> tagShift; }
+  constexpr uint32_t lineBase(uint32_t address) const {
+    return address & ~(lineBytes - 1);
+  }
+  constexpr uint32_t lineAddress(uint32_t tag, uint32_t index) const {
+    return tag << tagShift | index << offsetBits;
+  }
+
+  bool operator==(const CacheGeometry &other) const {
+    return sets == other.sets && ways == other.ways &&
+           lineBytes == other.lineBytes;
+  }
+  bool operator!=(const CacheGeometry &other) const {
+    return !(*this == other);
+  }
+
+  // "SETS:WAYS:LINE_BYTES", e.g. "8:2:16".
+  static bool parse(const std::string &text, CacheGeometry &geometry) {
+    uint32_t sets = 0, ways = 0, lineBytes = 0;
+    char tail = 0;
+    if (sscanf(text.c_str(), "%u:%u:%u%c", &sets, &ways, &lineBytes, &tail) !=
+        3)
+      return false;
+    geometry = CacheGeometry(sets, ways, lineBytes);
+    return geometry.valid();
+  }
+};
+
+// The caches of the reference design: 8 sets of 2 ways with 16-byte lines.
+constexpr CacheGeometry DEFAULT_CACHE(8, 2, 16);
+static_assert(DEFAULT_CACHE.valid() && DEFAULT_CACHE.offsetBits == 4 &&
+                  DEFAULT_CACHE.tagShift == 7,
+              "index is (address >> 4) & 7 and tag address >> 7");
+
+// Replacement policies. The cache asks its policy for a victim only when
+// every way of the set is valid, and tells it about hits (touch) and newly
+// filled lines (fill). Each keeps its state in a flat array indexed by set;
+// age() is the per-way value the trace prints after "age=".
+//
+//   unsigned victim(uint32_t set);
+//   void touch(uint32_t set, unsigned int way);
+//   void fill(uint32_t set, unsigned int way);
+//   unsigned age(uint32_t set, unsigned int way) const;
+
+// xorshift64*, so a seeded policy picks the same victims on every run.
+class PolicyRandom {
+public:
+  explicit PolicyRandom(uint64_t seed) : state(seed ? seed : 1) {}
+
+  uint32_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return static_cast<uint32_t>((state * 0x2545F4914F6CDD1DULL) >> 32);
+  }
+
+private:
+  uint64_t state;
+};
+
+// True LRU. Each way counts the accesses to its set since it was last used;
+// the victim is the way with the largest count, ties going to the higher
+// way. The trace prints the low byte of the count.
+class LruPolicy {
+public:
+  static constexpr const char *NAME = "lru";
+
+  LruPolicy(const CacheGeometry &geometry, uint64_t)
+      : ways(geometry.ways), counters(geometry.lines()) {}
+
+  unsigned victim(uint32_t set) const {
+    const uint32_t *count = &counters[set * ways];
+    unsigned int victim = 0;
+    for (unsigned int i = 1; i < ways; ++i) {
+      if (count[i] >= count[victim])
+        victim = i;
+    }
+    return victim;
+  }
+
+  void touch(uint32_t set, unsigned int way) {
+    uint32_t *count = &counters[set * ways];
+    for (unsigned int i = 0; i < ways; ++i)
+      count[i]++;
+    count[way] = 0;
+  }
+
+  void fill(uint32_t set, unsigned int way) { touch(set, way); }
+
+  unsigned age(uint32_t set, unsigned int way) const {
+    return static_cast<uint8_t>(counters[set * ways + way]);
+  }
+
+private:
+  uint32_t ways;
+  std::vector<uint32_t> counters;
+};
+
+// Tree pseudo-LRU: ways - 1 bits per set in one word, one per inner node of
+// a binary tree over the ways (node 1 is the root, node n has children 2n and
+// 2n + 1). A set bit sends the victim search right. With a way count that is
+// not a power of two, the search never enters a subtree without real ways.
+// The age of a way is how many nodes on its path point at it.
+class TreePlruPolicy {
+public:
+  static constexpr const char *NAME = "plru";
+
+  TreePlruPolicy(const CacheGeometry &geometry, uint64_t)
+      : ways(geometry.ways), leaves(1u << CacheGeometry::log2(geometry.ways)),
+        bits(geometry.sets) {}
+
+  unsigned victim(uint32_t set) const {
+    unsigned int node = 1;
+    while (node < leaves) {
+      const unsigned int right = 2 * node + 1;
+      node = (bits[set] >> node & 1) && firstLeaf(right) < ways ? right
+                                                                 : 2 * node;
+    }
+    return node - leaves;
+  }
+
+  void touch(uint32_t set, unsigned int way) {
+    for (unsigned int node = way + leaves; node > 1; node /= 2) {
+      if (node & 1)
+        bits[set] &= ~(uint64_t(1) << (node / 2));
+      else
+        bits[set] |= uint64_t(1) << (node / 2);
+    }
+  }
+
+  void fill(uint32_t set, unsigned int way) { touch(set, way); }
+
+  unsigned age(uint32_t set, unsigned int way) const {
+    unsigned int pointing = 0;
+    for (unsigned int node = way + leaves; node > 1; node /= 2)
+      pointing += (bits[set] >> (node / 2) & 1) == (node & 1);
+    return pointing;
+  }
+
+private:
+  uint32_t ways;
+  uint32_t leaves;
+  std::vector<uint64_t> bits;
+
+  unsigned int firstLeaf(unsigned int node) const {
+    while (node < leaves)
+      node *= 2;
+    return node - leaves;
+  }
+};
+
+// First in, first out: one byte per set names the way filled longest ago.
+// Hits do not change it. The oldest way has the largest age.
+class FifoPolicy {
+public:
+  static constexpr const char *NAME = "fifo";
+
+  FifoPolicy(const CacheGeometry &geometry, uint64_t)
+      : ways(geometry.ways), oldest(geometry.sets) {}
+
+  unsigned victim(uint32_t set) const { return oldest[set]; }
+
+  void touch(uint32_t, unsigned int) {}
+
+  void fill(uint32_t set, unsigned int way) {
+    oldest[set] = static_cast<uint8_t>((way + 1) % ways);
+  }
+
+  unsigned age(uint32_t set, unsigned int way) const {
+    return ways - 1 - (way + ways - oldest[set]) % ways;
+  }
+
+private:
+  uint32_t ways;
+  std::vector<uint8_t> oldest;
+};
+
+// Uniformly random victim from a seeded generator; no per-set state.
+class RandomPolicy {
+public:
+  static constexpr const char *NAME = "random";
+
+  RandomPolicy(const CacheGeometry &geometry, uint64_t seed)
+      : ways(geometry.ways), random(seed) {}
+
+  unsigned victim(uint32_t) { return random.next() % ways; }
+  void touch(uint32_t, unsigned int) {}
+  void fill(uint32_t, unsigned int) {}
+  unsigned age(uint32_t, unsigned int) const { return 0; }
+
+private:
+  uint32_t ways;
+  PolicyRandom random;
+};
+
+// Re-reference interval prediction with 2-bit values packed four ways to a
+// byte. A hit predicts a near re-reference (0); the victim is a way predicted
+// distant (3), after ageing the whole set until one is. SRRIP inserts new
+// lines at 2; BRRIP (BIMODAL) inserts at 3 and only one fill in 32 at 2, so a
+// scan does not flush the set. The age of a way is its prediction.
+template <bool BIMODAL> class RripPolicy {
+public:
+  static constexpr const char *NAME = BIMODAL ? "brrip" : "srrip";
+  static constexpr unsigned int DISTANT = 3;
+
+  RripPolicy(const CacheGeometry &geometry, uint64_t seed)
+      : ways(geometry.ways), bytesPerSet((geometry.ways + 3) / 4),
+        values(geometry.sets * bytesPerSet), random(seed) {}
+
+  unsigned victim(uint32_t set) {
+    for (;;) {
+      for (unsigned int i = 0; i < ways; ++i) {
+        if (age(set, i) == DISTANT)
+          return i;
+      }
+      for (unsigned int i = 0; i < ways; ++i)
+        setValue(set, i, age(set, i) + 1);
+    }
+  }
+
+  void touch(uint32_t set, unsigned int way) { setValue(set, way, 0); }
+
+  void fill(uint32_t set, unsigned int way) {
+    if (BIMODAL && random.next() % 32 != 0)
+      setValue(set, way, DISTANT);
+    else
+      setValue(set, way, DISTANT - 1);
+  }
+
+  unsigned age(uint32_t set, unsigned int way) const {
+    return values[set * bytesPerSet + way / 4] >> (2 * (way % 4)) & 3;
+  }
+
+private:
+  uint32_t ways;
+  uint32_t bytesPerSet;
+  std::vector<uint8_t> values;
+  PolicyRandom random;
+
+  void setValue(uint32_t set, unsigned int way, unsigned int value) {
+    uint8_t &byte = values[set * bytesPerSet + way / 4];
+    const unsigned int shift = 2 * (way % 4);
+    byte = static_cast<uint8_t>((byte & ~(3u << shift)) | (value << shift));
+  }
+};
+
+using SrripPolicy = RripPolicy<false>;
+using BrripPolicy = RripPolicy<true>;
+
+enum class AccessKind : uint8_t { FETCH, LOAD, STORE };
+
+// What a store does on a hit (update memory too, or only mark the line
+// dirty) and on a miss (fill the line first, or write memory alone).
+enum class WriteHit : uint8_t { THROUGH, BACK };
+enum class WriteMiss : uint8_t { NO_ALLOCATE, ALLOCATE };
+
+class WritePolicy {
+public:
+  WriteHit hit = WriteHit::THROUGH;
+  WriteMiss miss = WriteMiss::NO_ALLOCATE;
+
+  bool operator==(const WritePolicy &other) const {
+    return hit == other.hit && miss == other.miss;
+  }
+  bool operator!=(const WritePolicy &other) const {
+    return !(*this == other);
+  }
+};
+
+class CacheLine {
+public:
+  bool isValid = false;
+  bool dirty = false;
+  uint32_t tag = 0;
+};
+
+// Bytes moved between a cache and the memory behind it: line fills one way,
+// written-through stores and written-back dirty lines the other.
+class CacheTraffic {
+public:
+  uint64_t fills = 0;
+  uint64_t writebacks = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+};
+
+// Cycles an access takes at a cache level: `hit` when the line is there,
+// else `miss` plus the time the level below needs to deliver the line, or
+// `memory` when nothing is below. Writebacks and written-through stores are
+// buffered and add no time.
+class CacheLatency {
+public:
+  uint32_t hit = 1;
+  uint32_t miss = 1;
+  uint32_t memory = 50;
+};
+
+// Sorts the misses of a cache into the three Cs (--miss-classes): compulsory
+// until a line is first brought in, capacity when a fully associative LRU cache
+// of as many lines would also have missed, conflict otherwise. The shadow
+// cache is a hash map from line to slot plus an LRU list threaded through
+// flat arrays, so an access costs O(1) whatever the size.
+class MissClassifier {
+public:
+  uint64_t compulsory = 0;
+  uint64_t capacity = 0;
+  uint64_t conflict = 0;
+
+  explicit MissClassifier(const CacheGeometry &geometry)
+      : offsetBits(geometry.offsetBits), lines(geometry.lines()),
+        older(lines.size()), newer(lines.size()) {}
+
+  // `allocate`: whether the access brings its line in when it misses, false
+  // only for stores that do not allocate. Such a store leaves its line
+  // unseen, so the first miss that does bring the line in is compulsory too.
+  void access(uint32_t address, bool hit, bool allocate) {
+    const uint32_t line = address >> offsetBits;
+    auto found = slots.find(line);
+    if (!hit) {
+      if (found == slots.end())
+        compulsory++;
+      else if (found->second == NONE)
+        capacity++;
+      else
+        conflict++;
+    }
+    if (found != slots.end() && found->second != NONE) {
+      unlink(found->second);
+      pushFront(found->second);
+    } else if (allocate) {
+      if (found == slots.end())
+        found = slots.emplace(line, NONE).first;
+      uint32_t &slot = found->second;
+      if (used < lines.size()) {
+        slot = used++;
+      } else {
+        slot = lru;
+        unlink(slot);
+        slots[lines[slot]] = NONE;
+      }
+      lines[slot] = line;
+      pushFront(slot);
+    }
+  }
+
+private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  uint32_t offsetBits;
+  // Line held by each slot of the shadow cache, and the LRU list through the
+  // slots from mru to lru.
+  std::vector<uint32_t> lines;
+  std::vector<uint32_t> older;
+  std::vector<uint32_t> newer;
+  uint32_t mru = NONE;
+  uint32_t lru = NONE;
+  uint32_t used = 0;
+  // Every line ever brought in: its slot, or NONE once evicted.
+  std::unordered_map<uint32_t, uint32_t> slots;
+
+  void unlink(uint32_t slot) {
+    (older[slot] == NONE ? lru : newer[older[slot]]) = newer[slot];
+    (newer[slot] == NONE ? mru : older[newer[slot]]) = older[slot];
+  }
+
+  void pushFront(uint32_t slot) {
+    older[slot] = mru;
+    newer[slot] = NONE;
+    (mru == NONE ? lru : newer[mru]) = slot;
+    mru = slot;
+  }
+};
+
+// Starts a summary line: "#cache_mem:", the cache's name and `what`, padded
+// so that the values of all summary lines start in the same column.
+void writeCacheLabel(TraceWriter &output, std::string_view cache,
+                     std::string_view what) {
+  output << "#cache_mem:" << cache << what;
+  size_t column = cache.size() + what.size();
+  do
+    output << ' ';
+  while (++column < 22);
+}
+
+// A cache level behind the L1 caches (--l2, --l3). The level above tells it
+// about the lines it fills (a LOAD or FETCH of the whole line) and about what
+// it writes out (a STORE of a written-back line or a written-through store).
+// Levels hold tags only; the data stays in memory.
+class CacheLevel {
+public:
+  virtual ~CacheLevel() = default;
+  // Returns the cycles the access took.
+  virtual uint32_t access(uint32_t address, uint32_t size,
+                          AccessKind kind) = 0;
+  virtual void connect(CacheLevel *next) = 0;
+  virtual void setLatency(const CacheLatency &latency) = 0;
+  virtual void classifyMisses() = 0;
+  // Whether `other`, a level of the same kind, is in the same state.
+  virtual bool matches(const CacheLevel &other) const = 0;
+  virtual uint64_t hits() const = 0;
+  virtual uint64_t misses() const = 0;
+  virtual void printStats(TraceWriter &output) const = 0;
+  virtual void printTraffic(TraceWriter &output) const = 0;
+  virtual void printTiming(TraceWriter &output) const = 0;
+  // Snapshot and restore of the modeled state; the connection stays as is.
+  virtual std::unique_ptr<CacheLevel> clone() const = 0;
+  virtual void restore(const CacheLevel &saved) = 0;
+};
+
+// Tags and replacement state of a cache, without the data: lines live in one
+// array, set after set. The data-holding Cache is built on it, and on its own
+// it models a cache for statistics only. Fills and writes out also go to the
+// `next` level, if any.
+template <class Policy> class CacheModel {
+public:
+  CacheGeometry geometry;
+  std::vector<CacheLine> lines;
+  Policy policy;
+  WritePolicy writePolicy;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  CacheTraffic traffic;
+  CacheLatency latency;
+  // Cycles of all accesses so far, for the average memory access time.
+  uint64_t cycles = 0;
+  CacheLevel *next = nullptr;
+  std::optional<MissClassifier> missClasses;
+
+  explicit CacheModel(const CacheGeometry &shape, uint64_t seed = 1,
+                      WritePolicy write = {})
+      : geometry(shape), lines(shape.lines()), policy(shape, seed),
+        writePolicy(write) {}
+
+  void classifyMisses() { missClasses.emplace(geometry); }
+
+  void classify(uint32_t address, bool hit, bool allocate) {
+    if (missClasses)
+      missClasses->access(address, hit, allocate);
+  }
+
+  // Same lines, replacement ages and counters: what lockstep compares.
+  bool matches(const CacheModel &other) const {
+    if (hits != other.hits || misses != other.misses ||
+        cycles != other.cycles || traffic.fills != other.traffic.fills ||
+        traffic.writebacks != other.traffic.writebacks ||
+        traffic.bytesIn != other.traffic.bytesIn ||
+        traffic.bytesOut != other.traffic.bytesOut)
+      return false;
+    for (uint32_t index = 0; index < geometry.sets; ++index) {
+      for (unsigned int way = 0; way < geometry.ways; ++way) {
+        const CacheLine &line = set(index)[way];
+        const CacheLine &theirs = other.set(index)[way];
+        if (line.isValid != theirs.isValid || line.dirty != theirs.dirty ||
+            line.tag != theirs.tag ||
+            policy.age(index, way) != other.policy.age(index, way))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  CacheLine *set(uint32_t index) { return &lines[index * geometry.ways]; }
+  const CacheLine *set(uint32_t index) const {
+    return &lines[index * geometry.ways];
+  }
+
+  int findWay(uint32_t index, uint32_t tag) const {
+    const CacheLine *ways = set(index);
+    for (unsigned int i = 0; i < geometry.ways; ++i) {
+      if (ways[i].isValid && ways[i].tag == tag)
+        return static_cast<int>(i);
+    }
+    return -1;
+  }
+
+  // An invalid way if there is one, else the policy's choice.
+  unsigned int findVictim(uint32_t index) {
+    const CacheLine *ways = set(index);
+    for (unsigned int i = 0; i < geometry.ways; ++i) {
+      if (!ways[i].isValid)
+        return i;
+    }
+    return policy.victim(index);
+  }
+
+  // Puts line `tag` in `way`, counting the fill and, when the line it evicts
+  // is dirty, the writeback. `kind` is the access that missed; a store that
+  // allocates reads the line like a load. Returns the cycles of the miss.
+  uint32_t replace(uint32_t index, unsigned int way, uint32_t tag,
+                   AccessKind kind) {
+    CacheLine &line = set(index)[way];
+    const bool writeback = line.isValid && line.dirty;
+    if (writeback) {
+      traffic.writebacks++;
+      traffic.bytesOut += geometry.lineBytes;
+      if (next)
+        next->access(geometry.lineAddress(line.tag, index), geometry.lineBytes,
+                     AccessKind::STORE);
+    }
+    traffic.fills++;
+    traffic.bytesIn += geometry.lineBytes;
+    const uint32_t below =
+        next ? next->access(geometry.lineAddress(tag, index),
+                            geometry.lineBytes,
+                            kind == AccessKind::STORE ? AccessKind::LOAD : kind)
+             : latency.memory;
+    line = {true, false, tag};
+    policy.fill(index, way);
+    return latency.miss + below;
+  }
+
+  // Accounts for `size` bytes at `address` stored into `way`: a write-back
+  // line becomes dirty, a write-through store also goes out.
+  void store(uint32_t index, unsigned int way, uint32_t address,
+             uint32_t size) {
+    if (writePolicy.hit == WriteHit::BACK)
+      set(index)[way].dirty = true;
+    else
+      writeOut(address, size);
+  }
+
+  // A store that passes this level without a line to put it in.
+  void writeOut(uint32_t address, uint32_t size) {
+    traffic.bytesOut += size;
+    if (next)
+      next->access(address, size, AccessKind::STORE);
+  }
+
+  // Counts one access the way Cache does and returns the cycles it took.
+  uint32_t access(uint32_t address, uint32_t size, AccessKind kind) {
+    const uint32_t index = geometry.index(address);
+    const uint32_t tag = geometry.tag(address);
+    int way = findWay(index, tag);
+    const bool allocate = kind != AccessKind::STORE ||
+                          writePolicy.miss == WriteMiss::ALLOCATE;
+    classify(address, way >= 0, allocate);
+    uint32_t time = latency.hit;
+    if (way >= 0) {
+      hits++;
+      policy.touch(index, way);
+    } else {
+      misses++;
+      if (!allocate) {
+        writeOut(address, size);
+        cycles += latency.miss;
+        return latency.miss;
+      }
+      way = findVictim(index);
+      time = replace(index, way, tag, kind);
+    }
+    if (kind == AccessKind::STORE)
+      store(index, way, address, size);
+    cycles += time;
+    return time;
+  }
+
+  double averageCycles() const {
+    const uint64_t total = hits + misses;
+    return total == 0 ? 0.0 : static_cast<double>(cycles) / total;
+  }
+
+  double hitRate() const {
+    const uint64_t total = hits + misses;
+    return total == 0 ? 0.0 : static_cast<double>(hits) / total;
+  }
+};
+
+// Line fills and writebacks, and the bytes each way between a cache and the
+// level behind it (--cache-traffic).
+void printCacheTraffic(TraceWriter &output, std::string_view cache,
+                       const CacheTraffic &traffic) {
+  writeCacheLabel(output, cache, "traffic");
+  output << "fills=" << traffic.fills << ",writebacks=" << traffic.writebacks
+         << ",bytes_in=" << traffic.bytesIn
+         << ",bytes_out=" << traffic.bytesOut << '\n';
+}
+
+// The misses of a cache by class (--miss-classes), if it counts them.
+void printMissClasses(TraceWriter &output, std::string_view cache,
+                      const std::optional<MissClassifier> &classes) {
+  if (!classes)
+    return;
+  writeCacheLabel(output, cache, "misses");
+  output << "compulsory=" << classes->compulsory
+         << ",capacity=" << classes->capacity
+         << ",conflict=" << classes->conflict << '\n';
+}
+
+// The same accesses replayed on tag-only models under every policy
+// (--compare-policies), so one run shows what each would hit.
+class PolicyComparison {
+public:
+  PolicyComparison(const CacheGeometry &geometry, uint64_t seed,
+                   WritePolicy write)
+      : models(CacheModel<LruPolicy>(geometry, seed, write),
+               CacheModel<TreePlruPolicy>(geometry, seed, write),
+               CacheModel<FifoPolicy>(geometry, seed, write),
+               CacheModel<RandomPolicy>(geometry, seed, write),
+               CacheModel<SrripPolicy>(geometry, seed, write),
+               CacheModel<BrripPolicy>(geometry, seed, write)) {}
+
+  void access(uint32_t address, uint32_t size, AccessKind kind) {
+    std::apply(
+        [&](auto &...model) { (model.access(address, size, kind), ...); },
+        models);
+  }
+
+  void print(TraceWriter &output, const std::string &cacheType) const {
+    std::apply(
+        [&](const auto &...model) {
+          (printModel(output, cacheType, model), ...);
+        },
+        models);
+  }
+
+private:
+  std::tuple<CacheModel<LruPolicy>, CacheModel<TreePlruPolicy>,
+             CacheModel<FifoPolicy>, CacheModel<RandomPolicy>,
+             CacheModel<SrripPolicy>, CacheModel<BrripPolicy>>
+      models;
+
+  template <class Policy>
+  static void printModel(TraceWriter &output, const std::string &cacheType,
+                         const CacheModel<Policy> &model) {
+    writeCacheLabel(output, cacheType,
+                    std::string("policy=") + Policy::NAME);
+    output << "hit=" << fixed_format(model.hitRate(), 4) << '\n';
+  }
+};
+
+// Sees every access a cache is asked for, as the cache gets it: the
+// --explore models and the --access-trace file.
+class AccessListener {
+public:
+  virtual ~AccessListener() = default;
+  virtual void add(uint32_t address, uint32_t size, AccessKind kind) = 0;
+};
+
+// Where the misses of a cache come from (--miss-profile): accesses and misses
+// by the pc of the instruction that made them, and by set within each
+// interval of `interval` instructions. The hart's pc and instret are read
+// as each access happens. Counters live in flat arrays: one slot per
+// instruction word of RAM, and one row of sets per interval.
+class MissProfile {
+public:
+  MissProfile(const CacheGeometry &geometry, const uint32_t &pc,
+              const uint64_t &instret, uint64_t interval)
+      : sets(geometry.sets), pc(pc), instret(instret), interval(interval),
+        pcAccesses(MemoryMap::RAM_SIZE / 4),
+        pcMisses(MemoryMap::RAM_SIZE / 4) {}
+
+  void access(uint32_t index, bool hit) {
+    const uint32_t word = (pc - MemoryMap::OFFSET) >> 2;
+    if (word < pcAccesses.size()) {
+      pcAccesses[word]++;
+      pcMisses[word] += !hit;
+    }
+    const size_t cell = (instret / interval * sets + index) * 2;
+    if (cell >= heatmap.size())
+      heatmap.resize((instret / interval + 1) * sets * 2);
+    heatmap[cell]++;
+    heatmap[cell + 1] += !hit;
+  }
+
+  // The `top` pcs with the most misses, then one heatmap row per interval
+  // with accesses/misses for every set.
+  void print(TraceWriter &output, std::string_view cache, size_t top) const {
+    std::vector<uint32_t> words;
+    for (uint32_t word = 0; word < pcMisses.size(); ++word) {
+      if (pcMisses[word])
+        words.push_back(word);
+    }
+    top = std::min(top, words.size());
+    std::partial_sort(words.begin(), words.begin() + top, words.end(),
+                      [&](uint32_t a, uint32_t b) {
+                        return pcMisses[a] != pcMisses[b]
+                                   ? pcMisses[a] > pcMisses[b]
+                                   : a < b;
+                      });
+    for (size_t rank = 0; rank < top; ++rank) {
+      const uint32_t word = words[rank];
+      writeCacheLabel(output, cache, "misspc");
+      output << "rank=" << static_cast<uint64_t>(rank + 1)
+             << ",pc=" << hex_format(MemoryMap::OFFSET + word * 4, 8)
+             << ",misses=" << pcMisses[word]
+             << ",accesses=" << pcAccesses[word] << '\n';
+    }
+    for (size_t row = 0; row * sets * 2 < heatmap.size(); ++row) {
+      writeCacheLabel(output, cache, "missmap");
+      output << "from=" << static_cast<uint64_t>(row * interval) << ",sets=";
+      for (uint32_t set = 0; set < sets; ++set) {
+        const size_t cell = (row * sets + set) * 2;
+        if (set)
+          output << ' ';
+        output << heatmap[cell] << '/' << heatmap[cell + 1];
+      }
+      output << '\n';
+    }
+  }
+
+private:
+  uint32_t sets;
+  const uint32_t &pc;
+  const uint64_t &instret;
+  uint64_t interval;
+  std::vector<uint64_t> pcAccesses;
+  std::vector<uint64_t> pcMisses;
+  // Accesses and misses of each set, interval after interval.
+  std::vector<uint32_t> heatmap;
+};
+
+// A cache with its data: the words of each line sit in an array laid out like
+// the lines, wordsPerLine() per line. By default stores go through to memory
+// and do not allocate; with a write-back policy a dirty line reaches memory
+// only when it is evicted.
+template <class Policy> class BasicCache {
+private:
+  CacheModel<Policy> tags;
+  std::vector<uint32_t> words;
+  std::optional<PolicyComparison> comparison;
+  std::vector<AccessListener *> listeners;
+  MissProfile *profile = nullptr;
+  std::string cacheType;
+  TraceWriter &output;
+  AccessKind reads;
+
+  uint32_t *block(uint32_t index, unsigned int way) {
+    return &words[(index * tags.geometry.ways + way) *
+                  tags.geometry.wordsPerLine()];
+  }
+  const uint32_t *block(uint32_t index, unsigned int way) const {
+    return &words[(index * tags.geometry.ways + way) *
+                  tags.geometry.wordsPerLine()];
+  }
+
+  void noteAccess(bool hit, uint32_t index, unsigned int way) {
+    lastAccess = 0x80000000 | (hit ? 0x40000000 : 0) |
+                 ((index * tags.geometry.ways + way) & 0x3FFFFFFF);
+  }
+
+  // Evicts whatever `way` holds, writing it back first if it is dirty, and
+  // loads the line at `address` from memory in its place. Returns the cycles
+  // of the miss.
+  uint32_t fill(uint32_t index, unsigned int way, uint32_t address,
+                AccessKind kind, std::vector<uint8_t> &mem) {
+    const CacheGeometry &geometry = tags.geometry;
+    uint32_t *data = block(index, way);
+    const CacheLine &old = tags.set(index)[way];
+    const bool writeback = old.isValid && old.dirty;
+    const uint32_t oldBase = geometry.lineAddress(old.tag, index);
+    const uint32_t time = tags.replace(index, way, geometry.tag(address), kind);
+    if (writeback) {
+      for (uint32_t i = 0; i < geometry.wordsPerLine(); ++i) {
+        const uint32_t memIndex = oldBase + i * 4 - MemoryMap::OFFSET;
+        if (memIndex + 3 < mem.size())
+          storeMemory(mem, memIndex, data[i], 0b010);
+      }
+    }
+
+    const uint32_t blockStartAddr = geometry.lineBase(address);
+    for (uint32_t i = 0; i < geometry.wordsPerLine(); ++i) {
+      uint32_t memAddr = blockStartAddr + (i * 4);
+      uint32_t memIndex = memAddr - MemoryMap::OFFSET;
+      if (memIndex + 3 < mem.size()) {
+        data[i] = (mem[memIndex + 0] << 0) | (mem[memIndex + 1] << 8) |
+                  (mem[memIndex + 2] << 16) | (mem[memIndex + 3] << 24);
+      }
+    }
+    return time;
+  }
+
+  static void storeMemory(std::vector<uint8_t> &mem, uint32_t memIndex,
+                          uint32_t data, uint8_t funct3) {
+    if (funct3 == 0b000) {
+      mem[memIndex] = data & 0xFF;
+    } else if (funct3 == 0b001) {
+      mem[memIndex] = data & 0xFF;
+      mem[memIndex + 1] = (data >> 8) & 0xFF;
+    } else if (funct3 == 0b010) {
+      mem[memIndex] = data & 0xFF;
+      mem[memIndex + 1] = (data >> 8) & 0xFF;
+      mem[memIndex + 2] = (data >> 16) & 0xFF;
+      mem[memIndex + 3] = (data >> 24) & 0xFF;
+    }
+  }
+
+  void logHit(char kind, uint32_t address, uint32_t index, unsigned int way) {
+    const CacheLine &line = tags.set(index)[way];
+    const uint32_t *data = block(index, way);
+    output << "#cache_mem:" << cacheType << kind << "h "
+           << hex_format(address, 8) << "       line=" << index
+           << ",age=" << tags.policy.age(index, way)
+           << ",id=" << hex_format(line.tag, 6) << ",block[" << way << "]={";
+    for (uint32_t i = 0; i < tags.geometry.wordsPerLine(); ++i) {
+      if (i)
+        output << ',';
+      output << hex_format(data[i], 8);
+    }
+    output << "}" << '\n';
+  }
+
+  // The ages are listed from the highest way down, as in the two-way format.
+  void logMiss(char kind, uint32_t address, uint32_t index) {
+    const CacheLine *ways = tags.set(index);
+    const uint32_t count = tags.geometry.ways;
+    output << "#cache_mem:" << cacheType << kind << "m "
+           << hex_format(address, 8) << "       line=" << index << ",valid={";
+    for (unsigned int i = 0; i < count; ++i) {
+      if (i)
+        output << ',';
+      output << ways[i].isValid;
+    }
+    output << "},age={";
+    for (unsigned int i = count; i-- > 0;) {
+      output << tags.policy.age(index, i);
+      if (i)
+        output << ',';
+    }
+    output << "},id={";
+    for (unsigned int i = 0; i < count; ++i) {
+      if (i)
+        output << ',';
+      output << hex_format(ways[i].tag, 6);
+    }
+    output << "}" << '\n';
+  }
+
+public:
+  // Most recent access for binary trace records. Bit 31: valid, bit 30: hit,
+  // bits 0-29: set * ways + way, which holds every line of any cache small
+  // enough to simulate.
+  uint32_t lastAccess = 0;
+
+  // `reads`: what a read is, FETCH for an i-cache and LOAD otherwise.
+  BasicCache(const std::string &name, TraceWriter &out,
+             const CacheGeometry &shape = DEFAULT_CACHE,
+             AccessKind reads = AccessKind::LOAD, uint64_t seed = 1)
+      : tags(shape, seed), words(shape.lines() * shape.wordsPerLine()),
+        cacheType(name), output(out), reads(reads) {}
+
+  BasicCache(const BasicCache &) = default;
+
+  const CacheGeometry &shape() const { return tags.geometry; }
+
+  // Call before comparePolicies, whose models take the same write policy.
+  void setWritePolicy(WritePolicy write) { tags.writePolicy = write; }
+  WritePolicy writePolicy() const { return tags.writePolicy; }
+
+  void comparePolicies(uint64_t seed) {
+    comparison.emplace(shape(), seed, tags.writePolicy);
+  }
+
+  // Misses and writes out go to `next` instead of straight to memory.
+  void connect(CacheLevel *next) { tags.next = next; }
+
+  // Hits and misses from now on are also counted in `misses`.
+  void profileMisses(MissProfile *misses) { profile = misses; }
+
+  // Every access from now on also goes to `listener`.
+  void listen(AccessListener *listener) { listeners.push_back(listener); }
+
+  void setLatency(const CacheLatency &latency) { tags.latency = latency; }
+
+  void classifyMisses() { tags.classifyMisses(); }
+
+  bool matches(const BasicCache &other) const {
+    return tags.matches(other.tags) && words == other.words;
+  }
+
+  // Cycles of all reads and writes so far.
+  uint64_t cycles() const { return tags.cycles; }
+
+  template <class Trace>
+  uint32_t read(uint32_t address, std::vector<uint8_t> &mem) {
+    const CacheGeometry &geometry = tags.geometry;
+    const uint32_t offset = geometry.word(address);
+    const uint32_t index = geometry.index(address);
+    const uint32_t tag = geometry.tag(address);
+    if (comparison)
+      comparison->access(address, 4, reads);
+    for (AccessListener *listener : listeners)
+      listener->add(address, 4, reads);
+
+    const int way = tags.findWay(index, tag);
+    tags.classify(address, way >= 0, true);
+    if (profile)
+      profile->access(index, way >= 0);
+    if (way >= 0) {
+      tags.hits++;
+      noteAccess(true, index, way);
+      if constexpr (Trace::CACHE_EVENTS)
+        logHit('r', address, index, way);
+      tags.policy.touch(index, way);
+      tags.cycles += tags.latency.hit;
+      return block(index, way)[offset];
+    }
+
+    tags.misses++;
+    const unsigned int victimWay = tags.findVictim(index);
+    noteAccess(false, index, victimWay);
+    if constexpr (Trace::CACHE_EVENTS)
+      logMiss('r', address, index);
+    tags.cycles += fill(index, victimWay, address, reads, mem);
+    return block(index, victimWay)[offset];
+  }
+
+  template <class Trace>
+  void write(uint32_t address, uint32_t data, uint8_t funct3,
+             std::vector<uint8_t> &mem) {
+    const CacheGeometry &geometry = tags.geometry;
+    const uint32_t offset = geometry.word(address);
+    const uint32_t index = geometry.index(address);
+    const uint32_t tag = geometry.tag(address);
+    const uint32_t byte_offset = address & 0x3;
+    const uint32_t memIndex = address - MemoryMap::OFFSET;
+    const uint32_t size = 1u << funct3;
+    if (comparison)
+      comparison->access(address, size, AccessKind::STORE);
+    for (AccessListener *listener : listeners)
+      listener->add(address, size, AccessKind::STORE);
+
+    int way = tags.findWay(index, tag);
+    tags.classify(address, way >= 0,
+                  tags.writePolicy.miss == WriteMiss::ALLOCATE);
+    if (profile)
+      profile->access(index, way >= 0);
+    if (way >= 0) {
+      tags.hits++;
+      noteAccess(true, index, way);
+      if constexpr (Trace::CACHE_EVENTS)
+        logHit('w', address, index, way);
+      tags.policy.touch(index, way);
+      tags.cycles += tags.latency.hit;
+    } else {
+      tags.misses++;
+      if (tags.writePolicy.miss == WriteMiss::ALLOCATE)
+        way = tags.findVictim(index);
+      noteAccess(false, index, way >= 0 ? way : 0);
+      if constexpr (Trace::CACHE_EVENTS)
+        logMiss('w', address, index);
+      if (way < 0) {
+        tags.writeOut(address, size);
+        tags.cycles += tags.latency.miss;
+        storeMemory(mem, memIndex, data, funct3);
+        return;
+      }
+      tags.cycles += fill(index, way, address, AccessKind::STORE, mem);
+    }
+
+    uint32_t &word = block(index, way)[offset];
+    if (funct3 == 0b000) {
+      uint32_t mask = ~(0xFF << (byte_offset * 8));
+      word = (word & mask) | ((data & 0xFF) << (byte_offset * 8));
+    } else if (funct3 == 0b001) {
+      uint32_t mask = ~(0xFFFF << (byte_offset * 8));
+      word = (word & mask) | ((data & 0xFFFF) << (byte_offset * 8));
+    } else if (funct3 == 0b010) {
+      word = data;
+    }
+    tags.store(index, way, address, size);
+    if (tags.writePolicy.hit == WriteHit::THROUGH)
+      storeMemory(mem, memIndex, data, funct3);
+  }
+
+  // Returns the resident word at address without touching the replacement
+  // state or the statistics, or nullptr when its line is not cached.
+  const uint32_t *peek(uint32_t address) const {
+    const CacheGeometry &geometry = tags.geometry;
+    const uint32_t index = geometry.index(address);
+    const int way = tags.findWay(index, geometry.tag(address));
+    return way < 0 ? nullptr : &block(index, way)[geometry.word(address)];
+  }
+
+  // Copies the modeled contents and counters; the log stream, the next level,
+  // the listeners and the profile stay as they are.
+  BasicCache &operator=(const BasicCache &other) {
+    CacheLevel *const next = tags.next;
+    tags = other.tags;
+    tags.next = next;
+    words = other.words;
+    comparison = other.comparison;
+    return *this;
+  }
+
+  void printStats() {
+    writeCacheLabel(output, cacheType, "stats");
+    output << "hit=" << fixed_format(tags.hitRate(), 4) << '\n';
+    printMissClasses(output, cacheType, tags.missClasses);
+    if (comparison)
+      comparison->print(output, cacheType);
+  }
+
+  void printTraffic() { printCacheTraffic(output, cacheType, tags.traffic); }
+
+  void printTiming() {
+    writeCacheLabel(output, cacheType, "amat");
+    output << "amat=" << fixed_format(tags.averageCycles(), 4) << '\n';
+  }
+};
+
+// The emulator's caches replace with true LRU, whose counters the trace
+// prints as ages.
+using Cache = BasicCache<LruPolicy>;
+
+// An outer cache level: a CacheModel under any policy behind the CacheLevel
+// interface, so levels of different policies chain at run time.
+template <class Policy> class ModelLevel : public CacheLevel {
+public:
+  ModelLevel(const std::string &name, const CacheGeometry &geometry,
+             WritePolicy write, uint64_t seed)
+      : name(name), model(geometry, seed, write) {}
+
+  uint32_t access(uint32_t address, uint32_t size, AccessKind kind) override {
+    return model.access(address, size, kind);
+  }
+
+  void connect(CacheLevel *next) override { model.next = next; }
+
+  void setLatency(const CacheLatency &latency) override {
+    model.latency = latency;
+  }
+
+  void classifyMisses() override { model.classifyMisses(); }
+
+  bool matches(const CacheLevel &other) const override {
+    return model.matches(static_cast<const ModelLevel &>(other).model);
+  }
+
+  uint64_t hits() const override { return model.hits; }
+  uint64_t misses() const override { return model.misses; }
+
+  void printStats(TraceWriter &output) const override {
+    writeCacheLabel(output, name, "stats");
+    output << "hit=" << fixed_format(model.hitRate(), 4) << '\n';
+    printMissClasses(output, name, model.missClasses);
+  }
+
+  void printTraffic(TraceWriter &output) const override {
+    printCacheTraffic(output, name, model.traffic);
+  }
+
+  void printTiming(TraceWriter &output) const override {
+    writeCacheLabel(output, name, "amat");
+    output << "amat=" << fixed_format(model.averageCycles(), 4) << '\n';
+  }
+
+  std::unique_ptr<CacheLevel> clone() const override {
+    return std::make_unique<ModelLevel>(*this);
+  }
+
+  void restore(const CacheLevel &saved) override {
+    CacheLevel *const next = model.next;
+    model = static_cast<const ModelLevel &>(saved).model;
+    model.next = next;
+  }
+
+private:
+  std::string name;
+  CacheModel<Policy> model;
+};
+
+// The level for a policy named as in Policy::NAME, or nullptr if there is no
+// such policy.
+std::unique_ptr<CacheLevel> makeCacheLevel(const std::string &name,
+                                           const CacheGeometry &geometry,
+                                           const std::string &policy,
+                                           WritePolicy write, uint64_t seed) {
+  std::unique_ptr<CacheLevel> level;
+  auto make = [&](auto *tag) {
+    using Policy = std::remove_pointer_t<decltype(tag)>;
+    if (policy == Policy::NAME)
+      level = std::make_unique<ModelLevel<Policy>>(name, geometry, write, seed);
+  };
+  make(static_cast<LruPolicy *>(nullptr));
+  make(static_cast<TreePlruPolicy *>(nullptr));
+  make(static_cast<FifoPolicy *>(nullptr));
+  make(static_cast<RandomPolicy *>(nullptr));
+  make(static_cast<SrripPolicy *>(nullptr));
+  make(static_cast<BrripPolicy *>(nullptr));
+  return level;
+}
+
+// Parses SETS:WAYS:LINE[:POLICY]; `policy` is left as it is when the spec
+// names none.
+bool parseCacheSpec(std::string spec, CacheGeometry &geometry,
+                    std::string &policy) {
+  const size_t second = spec.find(':', spec.find(':') + 1);
+  const size_t third = spec.find(':', second + 1);
+  if (second != std::string::npos && third != std::string::npos) {
+    policy = spec.substr(third + 1);
+    spec.resize(third);
+  }
+  return CacheGeometry::parse(spec, geometry);
+}
+
+// Cache configurations explored side by side (--explore=FILE): the accesses
+// of one run go in batches to worker threads, each of which owns some of the
+// configurations and replays every batch on their i- and d-cache models.
+class CacheExplorer : public AccessListener {
+public:
+  // One line of the file: NAME SETS:WAYS:LINE[:POLICY], optionally followed
+  // by the d-cache's write=through|back and write-miss=allocate|no-allocate.
+  class Config {
+  public:
+    std::string name;
+    CacheGeometry geometry = DEFAULT_CACHE;
+    std::string policy = LruPolicy::NAME;
+    WritePolicy write;
+  };
+
+  // Blank lines and everything after '#' are ignored.
+  static std::vector<Config> load(const std::string &path) {
+    std::ifstream input(path);
+    if (!input) {
+      std::cerr << "FATAL: cannot read " << path << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::vector<Config> configs;
+    std::string text;
+    for (unsigned lineNumber = 1; std::getline(input, text); ++lineNumber) {
+      text.resize(std::min(text.size(), text.find('#')));
+      std::istringstream words(text);
+      Config config;
+      std::string shape;
+      if (!(words >> config.name))
+        continue;
+      bool valid = words >> shape &&
+                   parseCacheSpec(shape, config.geometry, config.policy);
+      for (std::string word; valid && words >> word;) {
+        if (word == "write=through")
+          config.write.hit = WriteHit::THROUGH;
+        else if (word == "write=back")
+          config.write.hit = WriteHit::BACK;
+        else if (word == "write-miss=allocate")
+          config.write.miss = WriteMiss::ALLOCATE;
+        else if (word == "write-miss=no-allocate")
+          config.write.miss = WriteMiss::NO_ALLOCATE;
+        else
+          valid = false;
+      }
+      if (valid && !makeCacheLevel(config.name, config.geometry,
+                                   config.policy, config.write, 1))
+        valid = false;
+      if (!valid) {
+        std::cerr << "FATAL: " << path << ":" << lineNumber
+                  << ": expected NAME SETS:WAYS:LINE[:POLICY] "
+                     "[write=through|back] "
+                     "[write-miss=allocate|no-allocate]"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      configs.push_back(config);
+    }
+    if (configs.empty()) {
+      std::cerr << "FATAL: " << path << " has no cache configurations"
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return configs;
+  }
+
+  CacheExplorer(const std::vector<Config> &configs, unsigned threads,
+                uint64_t seed)
+      : filling(new Batch),
+        done(std::clamp<size_t>(threads, 1, configs.size()), 0) {
+    filling->reserve(BATCH_ACCESSES);
+    for (const Config &config : configs) {
+      models.push_back({config,
+                        makeCacheLevel("i", config.geometry, config.policy,
+                                       config.write, seed),
+                        makeCacheLevel("d", config.geometry, config.policy,
+                                       config.write, seed)});
+    }
+    for (unsigned i = 0; i < done.size(); ++i)
+      workers.emplace_back(&CacheExplorer::work, this, i);
+  }
+
+  ~CacheExplorer() { finish(); }
+
+  void add(uint32_t address, uint32_t size, AccessKind kind) override {
+    filling->push_back({address, static_cast<uint8_t>(size), kind});
+    if (filling->size() == BATCH_ACCESSES)
+      publish();
+  }
+
+  // Replays what is left, then stops the workers.
+  void finish() {
+    if (workers.empty())
+      return;
+    if (!filling->empty())
+      publish();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    batchReady.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+    workers.clear();
+  }
+
+  // One row per configuration; call after finish().
+  void print(TraceWriter &output) const {
+    auto rate = [](uint64_t hits, uint64_t misses) {
+      return hits + misses == 0
+                 ? 0.0
+                 : static_cast<double>(hits) / (hits + misses);
+    };
+    for (const Model &model : models) {
+      const CacheLevel &iCache = *model.iCache;
+      const CacheLevel &dCache = *model.dCache;
+      output << "#explore:" << std::string_view(model.config.name);
+      for (size_t i = 9 + model.config.name.size(); i < 32; ++i)
+        output << ' ';
+      output << "ihit=" << fixed_format(rate(iCache.hits(), iCache.misses()), 4)
+             << ",dhit="
+             << fixed_format(rate(dCache.hits(), dCache.misses()), 4)
+             << ",hit="
+             << fixed_format(rate(iCache.hits() + dCache.hits(),
+                                  iCache.misses() + dCache.misses()),
+                             4)
+             << '\n';
+    }
+  }
+
+private:
+  class Access {
+  public:
+    uint32_t address;
+    uint8_t size;
+    AccessKind kind;
+  };
+
+  class Model {
+  public:
+    Config config;
+    std::unique_ptr<CacheLevel> iCache;
+    std::unique_ptr<CacheLevel> dCache;
+  };
+
+  using Batch = std::vector<Access>;
+
+  static constexpr size_t BATCH_ACCESSES = 1 << 16;
+  static constexpr size_t MAX_IN_FLIGHT = 8;
+
+  std::vector<Model> models;
+  std::unique_ptr<Batch> filling;
+  // Published batches some worker still needs; batches.front() is number
+  // `first`. done[i] counts the batches worker i has replayed.
+  std::deque<std::shared_ptr<const Batch>> batches;
+  uint64_t first = 0;
+  std::vector<uint64_t> done;
+  std::mutex mutex;
+  std::condition_variable batchReady;
+  std::condition_variable batchDone;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  // Waits while MAX_IN_FLIGHT batches are ahead of the slowest worker.
+  void publish() {
+    std::shared_ptr<const Batch> batch(std::move(filling));
+    filling.reset(new Batch);
+    filling->reserve(BATCH_ACCESSES);
+    std::unique_lock<std::mutex> lock(mutex);
+    batches.push_back(std::move(batch));
+    batchReady.notify_all();
+    batchDone.wait(lock, [&] {
+      const uint64_t slowest = *std::min_element(done.begin(), done.end());
+      for (; first < slowest; ++first)
+        batches.pop_front();
+      return batches.size() <= MAX_IN_FLIGHT;
+    });
+  }
+
+  // Worker `id` owns the models whose index is id modulo the worker count.
+  void work(unsigned id) {
+    for (uint64_t next = 0;; ++next) {
+      std::shared_ptr<const Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        batchReady.wait(lock, [&] {
+          return stopping || next < first + batches.size();
+        });
+        if (next == first + batches.size())
+          return;
+        batch = batches[next - first];
+      }
+      for (size_t i = id; i < models.size(); i += done.size()) {
+        CacheLevel &iCache = *models[i].iCache;
+        CacheLevel &dCache = *models[i].dCache;
+        for (const Access &access : *batch) {
+          if (access.kind == AccessKind::FETCH)
+            iCache.access(access.address, access.size, access.kind);
+          else
+            dCache.access(access.address, access.size, access.kind);
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[id] = next + 1;
+      }
+      batchDone.notify_one();
+    }
+  }
+};
+
+// LRU stack distances of one access stream at line granularity
+// (--reuse-distance): for each access, the number of distinct lines touched
+// since the previous access to its line. A fully associative LRU cache of C
+// lines hits exactly the accesses at distance below C, so one histogram
+// gives the hit rate of every size. A Fenwick tree over access times holds
+// a 1 at the latest access of each line; the distance is a range sum, so an
+// access costs O(log n). Times are renumbered densely when the tree fills.
+class ReuseDistance : public AccessListener {
+public:
+  explicit ReuseDistance(uint32_t lineBytes)
+      : offsetBits(CacheGeometry::log2(lineBytes)), tree(INITIAL_TIMES + 1) {}
+
+  void add(uint32_t address, uint32_t, AccessKind) override {
+    if (now + 1 == tree.size())
+      renumber();
+    const auto found = last.try_emplace(address >> offsetBits, now);
+    if (found.second) {
+      cold++;
+    } else {
+      const uint64_t previous = found.first->second;
+      const uint64_t distance = sum(now) - sum(previous + 1);
+      if (distance >= histogram.size())
+        histogram.resize(distance + 1);
+      histogram[distance]++;
+      update(previous, -1);
+      found.first->second = now;
+    }
+    update(now, 1);
+    now++;
+  }
+
+  // One row per power-of-two size: the accesses at distances from the
+  // previous size up to this one, and the hit rate of a fully associative
+  // LRU cache of that many lines. The rows stop once every reuse hits.
+  void print(TraceWriter &output, std::string_view cache) const {
+    uint64_t accesses = cold;
+    for (uint64_t count : histogram)
+      accesses += count;
+    writeCacheLabel(output, cache, "reuse");
+    output << "accesses=" << accesses << ",cold=" << cold << '\n';
+    uint64_t hits = 0;
+    size_t distance = 0;
+    for (uint64_t lines = 1; distance < histogram.size(); lines *= 2) {
+      uint64_t count = 0;
+      for (; distance < lines && distance < histogram.size(); ++distance)
+        count += histogram[distance];
+      hits += count;
+      writeCacheLabel(output, cache, "reuse");
+      output << "lines=" << lines << ",count=" << count << ",hit="
+             << fixed_format(static_cast<double>(hits) / accesses, 4) << '\n';
+    }
+  }
+
+private:
+  static constexpr size_t INITIAL_TIMES = 1 << 16;
+
+  uint32_t offsetBits;
+  // Fenwick tree over times 0 .. size() - 2, stored 1-based.
+  std::vector<int32_t> tree;
+  uint64_t now = 0;
+  // Latest access time of every line seen.
+  std::unordered_map<uint32_t, uint64_t> last;
+  std::vector<uint64_t> histogram;
+  uint64_t cold = 0;
+
+  void update(uint64_t time, int32_t delta) {
+    for (uint64_t i = time + 1; i < tree.size(); i += i & -i)
+      tree[i] += delta;
+  }
+
+  // Lines whose latest access came before `time`.
+  uint64_t sum(uint64_t time) const {
+    uint64_t total = 0;
+    for (uint64_t i = time; i > 0; i -= i & -i)
+      total += tree[i];
+    return total;
+  }
+
+  // Gives the live lines times 0 .. n - 1 in their order and rebuilds the
+  // tree with room for as many accesses again.
+  void renumber() {
+    std::vector<std::pair<uint64_t, uint32_t>> order;
+    order.reserve(last.size());
+    for (const auto &entry : last)
+      order.emplace_back(entry.second, entry.first);
+    std::sort(order.begin(), order.end());
+    tree.assign(std::max(INITIAL_TIMES, 2 * order.size()) + 1, 0);
+    for (now = 0; now < order.size(); ++now) {
+      last[order[now].second] = now;
+      update(now, 1);
+    }
+  }
+};
+
+// Memory-access trace (--access-trace=FILE): an AccessTraceHeader and then
+// one AccessRecord per access the i- and d-caches were asked for, to be
+// replayed by cachereplay without emulating the program again. The din
+// format writes the same accesses as Dinero text lines instead.
+class AccessTraceHeader {
+public:
+  static constexpr char MAGIC[8] = {'P', 'O', 'X', 'I', 'M', 'A', 'T', '1'};
+
+  char magic[8];
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+
+// `label` is the Dinero label of the kind: 0 read, 1 write, 2 fetch.
+class AccessRecord {
+public:
+  uint32_t address;
+  uint8_t label;
+  uint8_t size;
+  uint16_t reserved;
+};
+
+static_assert(sizeof(AccessRecord) == 8, "access records are 8 bytes");
+
+constexpr uint8_t dineroLabel(AccessKind kind) {
+  return kind == AccessKind::LOAD ? 0 : kind == AccessKind::STORE ? 1 : 2;
+}
+
+constexpr AccessKind dineroKind(uint8_t label) {
+  return label == 0 ? AccessKind::LOAD
+                    : label == 1 ? AccessKind::STORE : AccessKind::FETCH;
+}
+
+class AccessTraceWriter : public AccessListener {
+public:
+  AccessTraceWriter(const std::string &path, bool din) : din(din) {
+    if (!output.open(path.c_str())) {
+      std::cerr << "FATAL: Failed to open " << path << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!din) {
+      AccessTraceHeader header = {};
+      std::memcpy(header.magic, AccessTraceHeader::MAGIC, 8);
+      header.recordSize = sizeof(AccessRecord);
+      output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+  }
+
+  // Word accesses leave out the size, which Dinero readers do not expect.
+  void add(uint32_t address, uint32_t size, AccessKind kind) override {
+    if (din) {
+      output << static_cast<uint32_t>(dineroLabel(kind)) << ' '
+             << hex_format(address, 8);
+      if (size != 4)
+        output << ' ' << size;
+      output << '\n';
+      return;
+    }
+    const AccessRecord record = {address, dineroLabel(kind),
+                                 static_cast<uint8_t>(size), 0};
+    output.write(reinterpret_cast<const char *>(&record), sizeof(record));
+  }
+
+private:
+  TraceWriter output;
+  bool din;
+};
+
+void loadMemory(std::ifstream &input, uint32_t offset,
+                std::vector<uint8_t> &mem) {
+  std::string lineBuffer;
+  uint32_t currentAddress = 0;
+  input.clear();
+  input.seekg(0, std::ios::beg);
+
+  while (std::getline(input, lineBuffer)) {
+    if (lineBuffer.empty())
+      continue;
+
+    if (lineBuffer[0] == '@') {
+      sscanf(lineBuffer.c_str(), "@%x", &currentAddress);
+    } else {
+      std::stringstream ss(lineBuffer);
+      unsigned int byteVal = 0;
+      while (ss >> std::hex >> byteVal) {
+        if (currentAddress >= offset) {
+          uint32_t memIndex = currentAddress - offset;
+          if (memIndex < mem.size()) {
+            mem[memIndex] = static_cast<uint8_t>(byteVal);
+          }
+        }
+        currentAddress++;
+      }
+    }
+  }
+}
+
+int32_t signedImmediate(uint16_t imm) {
+  return (imm & 0x800) ? (0xFFFFF000 | imm) : imm;
+}
+
+// Every operation the decoder can produce. Expanded into the Op enum and into
+// the dispatch tables of the execution engines.
+#define RV32_OPS(X)                                                            \
+  X(UNDECODED) X(NOP) X(ILLEGAL) X(LUI) X(AUIPC) X(ADDI) X(SLTI) X(SLTIU)      \
+  X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI) X(SRAI) X(ADD) X(SUB) X(SLL) X(SLT)   \
+  X(SLTU) X(XOR) X(SRL) X(SRA) X(OR) X(AND) X(MUL) X(MULH) X(MULHSU)           \
+  X(MULHU) X(DIV) X(DIVU) X(REM) X(REMU) X(LB) X(LH) X(LW) X(LBU) X(LHU)       \
+  X(LOAD_INVALID) X(SB) X(SH) X(SW) X(STORE_INVALID) X(BEQ) X(BNE) X(BLT)      \
+  X(BGE) X(BLTU) X(BGEU) X(BRANCH_INVALID) X(JAL) X(JALR) X(ECALL) X(EBREAK)   \
+  X(MRET) X(CSRRW) X(CSRRS) X(CSRRC) X(CSRRWI) X(CSRRSI) X(CSRRCI)
+
+enum class Op : uint8_t {
+#define OP_ENUM(name) name,
+  RV32_OPS(OP_ENUM)
+#undef OP_ENUM
+};
+
+const char *const opNames[] = {
+#define OP_NAME(name) #name,
+    RV32_OPS(OP_NAME)
+#undef OP_NAME
+};
+
+constexpr bool isLoad(Op op) { return op >= Op::LB && op <= Op::LOAD_INVALID; }
+
+constexpr bool isStore(Op op) {
+  return op >= Op::SB && op <= Op::STORE_INVALID;
+}
+
+constexpr bool isBranch(Op op) {
+  return op >= Op::BEQ && op <= Op::BRANCH_INVALID;
+}
+
+constexpr bool isCsr(Op op) { return op >= Op::CSRRW && op <= Op::CSRRCI; }
+
+// Pre-decoded form of one instruction word. `imm` holds the sign-extended
+// immediate of the format (shamt for shifts, CSR address for SYSTEM, upper
+// 20 bits for lui/auipc) and `raw` keeps the word it was decoded from.
+class DecodedInstruction {
+public:
+  Op op = Op::UNDECODED;
+  uint8_t rd = 0;
+  uint8_t rs1 = 0;
+  uint8_t rs2 = 0;
+  int32_t imm = 0;
+  uint32_t raw = 0;
+};
+
+DecodedInstruction decode(uint32_t instruction) {
+  const uint8_t opcode = instruction & 0x7F;
+  const uint8_t funct7 = (instruction >> 25) & 0x7F;
+  const uint8_t funct3 = (instruction >> 12) & 0x07;
+  const uint16_t imm = instruction >> 20;
+
+  DecodedInstruction inst;
+  inst.raw = instruction;
+  inst.rd = (instruction >> 7) & 0x1F;
+  inst.rs1 = (instruction >> 15) & 0x1F;
+  inst.rs2 = (instruction >> 20) & 0x1F;
+  inst.imm = signedImmediate(imm);
+  inst.op = Op::NOP;
+
+  switch (opcode) {
+  case 0b0010011: // I-Type
+    if (funct3 == 0b001 && funct7 == 0b0000000) {
+      inst.op = Op::SLLI;
+      inst.imm = inst.rs2;
+    } else if (funct3 == 0b000) {
+      inst.op = Op::ADDI;
+    } else if (funct3 == 0b111) {
+      inst.op = Op::ANDI;
+    } else if (funct3 == 0b110) {
+      inst.op = Op::ORI;
+    } else if (funct3 == 0b100) {
+      inst.op = Op::XORI;
+    } else if (funct3 == 0b010) {
+      inst.op = Op::SLTI;
+    } else if (funct3 == 0b011) {
+      inst.op = Op::SLTIU;
+    } else if (funct3 == 0b101 && funct7 == 0b0000000) {
+      inst.op = Op::SRLI;
+      inst.imm = inst.rs2;
+    } else if (funct3 == 0b101 && funct7 == 0b0100000) {
+      inst.op = Op::SRAI;
+      inst.imm = inst.rs2;
+    }
+    break;
+  case 0b0110111: // lui
+    inst.op = Op::LUI;
+    inst.imm = instruction & 0xFFFFF000;
+    break;
+  case 0b0010111: // auipc
+    inst.op = Op::AUIPC;
+    inst.imm = instruction & 0xFFFFF000;
+    break;
+  case 0b0000011: { // L-Type
+    static constexpr Op loads[8] = {Op::LB,           Op::LH,
+                                    Op::LW,           Op::LOAD_INVALID,
+                                    Op::LBU,          Op::LHU,
+                                    Op::LOAD_INVALID, Op::LOAD_INVALID};
+    inst.op = loads[funct3];
+    break;
+  }
+  case 0b0100011: { // S-Type
+    static constexpr Op stores[8] = {
+        Op::SB,            Op::SH,            Op::SW,
+        Op::STORE_INVALID, Op::STORE_INVALID, Op::STORE_INVALID,
+        Op::STORE_INVALID, Op::STORE_INVALID};
+    inst.op = stores[funct3];
+    inst.imm = signedImmediate(((instruction >> 25) & 0x7F) << 5 |
+                               ((instruction >> 7) & 0x1F));
+    break;
+  }
+  case 0b0110011: { // R-Type
+    static constexpr Op base[8] = {Op::ADD, Op::SLL, Op::SLT, Op::SLTU,
+                                   Op::XOR, Op::SRL, Op::OR,  Op::AND};
+    static constexpr Op muldiv[8] = {Op::MUL, Op::MULH, Op::MULHSU, Op::MULHU,
+                                     Op::DIV, Op::DIVU, Op::REM,    Op::REMU};
+    if (funct7 == 0b0000000)
+      inst.op = base[funct3];
+    else if (funct7 == 0b0000001)
+      inst.op = muldiv[funct3];
+    else if (funct7 == 0b0100000 && funct3 == 0b000)
+      inst.op = Op::SUB;
+    else if (funct7 == 0b0100000 && funct3 == 0b101)
+      inst.op = Op::SRA;
+    break;
+  }
+  case 0b1100011: { // B-Type
+    static constexpr Op branches[8] = {
+        Op::BEQ, Op::BNE,  Op::BRANCH_INVALID, Op::BRANCH_INVALID,
+        Op::BLT, Op::BGE,  Op::BLTU,           Op::BGEU};
+    const uint32_t imm12 = (instruction >> 19) & 0x1000;
+    const uint32_t imm11 = (instruction & 0x80) << 4;
+    const uint32_t imm10_5 = (instruction >> 20) & 0x7E0;
+    const uint32_t imm4_1 = (instruction >> 7) & 0x1E;
+    const uint32_t imm_b_unsigned = imm12 | imm11 | imm10_5 | imm4_1;
+    inst.op = branches[funct3];
+    inst.imm = (imm_b_unsigned & 0x1000) ? (0xFFFFE000 | imm_b_unsigned)
+                                         : imm_b_unsigned;
+    break;
+  }
+  case 0b1101111: { // JAL
+    const uint32_t imm_j_unsigned = (((instruction >> 31) & 0x1) << 20) |
+                                    (((instruction >> 12) & 0xFF) << 12) |
+                                    (((instruction >> 20) & 0x1) << 11) |
+                                    (((instruction >> 21) & 0x3FF) << 1);
+    inst.op = Op::JAL;
+    inst.imm = (imm_j_unsigned & 0x100000) ? (0xFFE00000 | imm_j_unsigned)
+                                           : imm_j_unsigned;
+    break;
+  }
+  case 0b1100111: // JALR
+    if (funct3 == 0b000)
+      inst.op = Op::JALR;
+    break;
+  case 0b1110011: { // SYSTEM
+    static constexpr Op csrOps[8] = {Op::ILLEGAL, Op::CSRRW,  Op::CSRRS,
+                                     Op::CSRRC,   Op::ILLEGAL, Op::CSRRWI,
+                                     Op::CSRRSI,  Op::CSRRCI};
+    inst.imm = imm;
+    if (funct3 == 0b000 && imm == 0)
+      inst.op = Op::ECALL;
+    else if (funct3 == 0b000 && imm == 0x302)
+      inst.op = Op::MRET;
+    else if (funct3 == 0b000 && imm == 1)
+      inst.op = Op::EBREAK;
+    else
+      inst.op = csrOps[funct3];
+    break;
+  }
+  default:
+    inst.op = Op::ILLEGAL;
+    break;
+  }
+  return inst;
+}
+
+// Decoded instructions indexed by guest word address. Entries are filled the
+// first time a PC executes and dropped again when a store hits their word.
+class DecodeCache {
+private:
+  std::vector<DecodedInstruction> entries;
+
+public:
+  explicit DecodeCache(size_t memSize) : entries(memSize / 4) {}
+
+  // The fetched word is checked against the entry as well, since the i-cache
+  // model may still hand out a line that is older than the last store.
+  const DecodedInstruction &lookup(uint32_t pc, uint32_t instruction) {
+    DecodedInstruction &entry = entries[(pc - MemoryMap::OFFSET) >> 2];
+    if (entry.op == Op::UNDECODED || entry.raw != instruction)
+      entry = decode(instruction);
+    return entry;
+  }
+
+  void invalidate(uint32_t address, uint32_t size) {
+    uint32_t first = (address - MemoryMap::OFFSET) >> 2;
+    uint32_t last = (address + size - 1 - MemoryMap::OFFSET) >> 2;
+    for (uint32_t i = first; i <= last && i < entries.size(); ++i)
+      entries[i].op = Op::UNDECODED;
+  }
+};
+
+class Hart;
+
+using JitFunction = uint64_t (*)(uint32_t *x, Hart *hart);
+
+// Entry of the table emitted by --translate: native code for the block that
+// starts at `pc`, one instantiation per TraceMode. `run` returns the next
+// translated block to chain into, or nullptr when control has to go back to
+// the dispatcher.
+class AotBlock {
+public:
+  uint32_t pc;
+  const AotBlock *(*run[5])(Hart &hart);
+};
+
+#define AOT_BLOCK(fn)                                                          \
+  {                                                                            \
+    fn<FullTrace>, fn<CacheTrace>, fn<StatsTrace>, fn<NoTrace>,                \
+        fn<BinaryTrace>                                                        \
+  }
+
+#ifdef POXIM_AOT
+extern const AotBlock aotBlocks[];
+extern const size_t aotBlockCount;
+#else
+const AotBlock *const aotBlocks = nullptr;
+const size_t aotBlockCount = 0;
+#endif
+
+// Straight-line run of decoded instructions that ends at a branch, jal, jalr
+// or SYSTEM instruction. `next` chains the blocks most recently reached from
+// this one so hot loops go block to block without a cache lookup.
+class Block {
+public:
+  static constexpr size_t MAX_LENGTH = 64;
+
+  uint32_t startPc = 0;
+  bool valid = true;
+  std::vector<DecodedInstruction> ops;
+  std::array<Block *, 2> next = {nullptr, nullptr};
+  uint32_t executions = 0;
+  JitFunction code = nullptr;
+  uint32_t codeLength = 0;
+};
+
+constexpr bool endsBlock(Op op) {
+  return isBranch(op) || op == Op::JAL || op == Op::JALR || op >= Op::ECALL ||
+         op == Op::ILLEGAL;
+}
+
+class BlockCache {
+private:
+  std::vector<std::unique_ptr<Block>> live;
+  std::vector<std::unique_ptr<Block>> retired;
+  std::vector<Block *> blockAt;
+  std::vector<uint16_t> coverage;
+  std::vector<uint32_t> heat;
+  const std::vector<uint8_t> &mem;
+
+  void drop(Block *block) {
+    if (block->code)
+      nativeDemoted++;
+    block->valid = false;
+    blockAt[(block->startPc - MemoryMap::OFFSET) >> 2] = nullptr;
+    const uint32_t first = (block->startPc - MemoryMap::OFFSET) >> 2;
+    for (uint32_t i = 0; i < block->ops.size(); ++i)
+      coverage[first + i]--;
+    for (auto &owner : live) {
+      if (owner.get() == block) {
+        retired.push_back(std::move(owner));
+        owner = std::move(live.back());
+        live.pop_back();
+        break;
+      }
+    }
+  }
+
+  Block *cached(uint32_t pc) const {
+    if ((pc & 0x3) || pc < MemoryMap::OFFSET ||
+        pc >= MemoryMap::OFFSET + mem.size())
+      return nullptr;
+    return blockAt[(pc - MemoryMap::OFFSET) >> 2];
+  }
+
+  Block *build(uint32_t pc) {
+    auto block = std::make_unique<Block>();
+    block->startPc = pc;
+    const uint32_t first = (pc - MemoryMap::OFFSET) >> 2;
+    for (uint32_t i = first;
+         i < coverage.size() && block->ops.size() < Block::MAX_LENGTH; ++i) {
+      const uint32_t at = i * 4;
+      const uint32_t word = mem[at] | (mem[at + 1] << 8) |
+                            (mem[at + 2] << 16) | (mem[at + 3] << 24);
+      block->ops.push_back(decode(word));
+      coverage[i]++;
+      if (endsBlock(block->ops.back().op))
+        break;
+    }
+    Block *raw = block.get();
+    blockAt[first] = raw;
+    live.push_back(std::move(block));
+    return raw;
+  }
+
+public:
+  uint64_t built = 0;
+  uint64_t invalidated = 0;
+  uint64_t nativeDemoted = 0;
+  uint32_t threshold = 1;
+
+  explicit BlockCache(const std::vector<uint8_t> &memory)
+      : blockAt(memory.size() / 4), coverage(memory.size() / 4),
+        heat(memory.size() / 4), mem(memory) {}
+
+  // Returns the block starting at pc, translating it once it has been looked
+  // up `threshold` times, or nullptr when pc cannot start a block (misaligned
+  // or outside RAM) or is still cold. A dropped block starts counting again.
+  Block *lookup(uint32_t pc) {
+    if ((pc & 0x3) || pc < MemoryMap::OFFSET ||
+        pc >= MemoryMap::OFFSET + mem.size())
+      return nullptr;
+    const uint32_t index = (pc - MemoryMap::OFFSET) >> 2;
+    Block *block = blockAt[index];
+    if (block)
+      return block;
+    if (++heat[index] < threshold)
+      return nullptr;
+    heat[index] = 0;
+    built++;
+    return build(pc);
+  }
+
+  // Follows (and if needed records) the chain from `from` to the block at pc.
+  Block *successor(Block &from, uint32_t pc) {
+    for (Block *candidate : from.next) {
+      if (candidate && candidate->valid && candidate->startPc == pc)
+        return candidate;
+    }
+    // Cold code is counted by the dispatcher only, not once more per edge.
+    Block *target = threshold > 1 ? cached(pc) : lookup(pc);
+    if (target) {
+      Block *&slot = (from.next[0] && from.next[0]->valid) ? from.next[1]
+                                                           : from.next[0];
+      slot = target;
+    }
+    return target;
+  }
+
+  // Drops every block that covers a byte in [address, address + size).
+  // Dropped blocks stay allocated until flushRetired() so chain pointers and
+  // the block currently executing remain safe to dereference.
+  void invalidate(uint32_t address, uint32_t size) {
+    const uint32_t first = (address - MemoryMap::OFFSET) >> 2;
+    const uint32_t last = (address + size - 1 - MemoryMap::OFFSET) >> 2;
+    for (uint32_t word = first; word <= last && word < coverage.size();
+         ++word) {
+      if (coverage[word] == 0)
+        continue;
+      const uint32_t lowest =
+          word >= Block::MAX_LENGTH - 1 ? word - (Block::MAX_LENGTH - 1) : 0;
+      for (uint32_t start = word + 1; start-- > lowest && coverage[word];) {
+        Block *block = blockAt[start];
+        if (block && start + block->ops.size() > word) {
+          drop(block);
+          invalidated++;
+        }
+      }
+    }
+  }
+
+  // Forgets all native code, e.g. after the JIT buffer was recycled.
+  void dropCode() {
+    for (auto &block : live) {
+      block->code = nullptr;
+      block->codeLength = 0;
+      block->executions = 0;
+    }
+  }
+
+  // Frees dropped blocks once enough have piled up. Only call this between
+  // blocks: it clears every chain so no pointer to a freed block survives.
+  void flushRetired() {
+    if (retired.size() < 1024)
+      return;
+    for (auto &block : live)
+      block->next = {nullptr, nullptr};
+    retired.clear();
+  }
+};
+
+void loadRd(uint32_t data, uint8_t rd, std::array<uint32_t, 32> &x) {
+  if (rd != 0) {
+    x[rd] = data;
+  }
+}
+
+void triggerException(uint32_t cause, uint32_t tval, uint32_t &pc,
+                      uint32_t &mepc, uint32_t &mcause, uint32_t &mtvec,
+                      uint32_t &mtval, uint32_t &mstatus) {
+  mepc = pc;
+  mcause = cause;
+  mtval = tval;
+
+  uint32_t mie = (mstatus >> 3) & 1;
+  mstatus &= ~(1 << 7);
+  mstatus |= (mie << 7);
+  mstatus &= ~(1 << 3);
+  mstatus &= ~(0b11 << 11);
+  mstatus |= (0b11 << 11);
+
+  if ((mtvec & 0x1) && (cause & 0x80000000)) {
+    uint32_t base = mtvec & ~0x3;
+    uint32_t cause_num = cause & 0x7FFFFFFF;
+    pc = base + (4 * cause_num);
+  } else {
+    pc = mtvec & ~0x3;
+  }
+}
+
+constexpr std::string_view getCsrName(uint16_t address) {
+  switch (address) {
   case 0x300:
     return "mstatus";
   case 0x304:
@@ -318,855 +2839,3010 @@ const char *getCsrName(uint16_t address) {
   }
 }
 
-uint32_t readCsr(uint16_t address, uint32_t mepc, uint32_t mcause,
-                 uint32_t mtvec, uint32_t mtval, uint32_t mstatus, uint32_t mie,
-                 uint32_t mip) {
-  switch (address) {
-  case 0x300:
-    return mstatus;
-  case 0x304:
-    return mie;
-  case 0x305:
-    return mtvec;
-  case 0x341:
-    return mepc;
-  case 0x342:
-    return mcause;
-  case 0x343:
-    return mtval;
-  case 0x344:
-    return mip;
+uint32_t readCsr(uint16_t address, uint32_t mepc, uint32_t mcause,
+                 uint32_t mtvec, uint32_t mtval, uint32_t mstatus, uint32_t mie,
+                 uint32_t mip) {
+  switch (address) {
+  case 0x300:
+    return mstatus;
+  case 0x304:
+    return mie;
+  case 0x305:
+    return mtvec;
+  case 0x341:
+    return mepc;
+  case 0x342:
+    return mcause;
+  case 0x343:
+    return mtval;
+  case 0x344:
+    return mip;
+  default:
+    return 0;
+  }
+}
+
+void writeCsr(uint16_t address, uint32_t data, uint32_t &mepc, uint32_t &mcause,
+              uint32_t &mtvec, uint32_t &mtval, uint32_t &mstatus,
+              uint32_t &mie, uint32_t &mip) {
+  switch (address) {
+  case 0x300:
+    mstatus = data;
+    break;
+  case 0x304:
+    mie = data;
+    break;
+  case 0x305:
+    mtvec = data;
+    break;
+  case 0x341:
+    mepc = data;
+    break;
+  case 0x342:
+    mcause = data;
+    break;
+  case 0x343:
+    mtval = data;
+    break;
+  case 0x344:
+    mip = data;
+    break;
+  }
+}
+
+// Native code for hot blocks. A compiled block is called as fn(x, hart) and
+// returns (retired << 32) | nextPc. Guest registers stay in hart.x; host
+// registers only hold temporaries, so every side exit leaves the guest state
+// exactly as the interpreter would at that instruction boundary.
+int64_t jitLoad(Hart *hart, uint32_t address, uint32_t op, uint32_t pc);
+uint32_t jitStore(Hart *hart, uint32_t address, uint32_t data, uint32_t op,
+                  uint32_t pc);
+
+class Jit {
+private:
+  static constexpr size_t BUFFER_SIZE = 4 * 1024 * 1024;
+  static constexpr size_t MAX_BLOCK_CODE = 64 * 1024;
+
+  uint8_t *buffer = nullptr;
+  size_t used = 0;
+  bool warned = false;
+  std::vector<uint8_t> code;
+  // Exit stubs are emitted after the block body so the hot path stays dense.
+  std::vector<std::pair<size_t, uint64_t>> exits;
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+  }
+
+  void emit32(uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+      code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+
+  void emit64(uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+      code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+
+  static uint8_t slot(uint8_t reg) { return static_cast<uint8_t>(reg * 4); }
+
+  // mov r32, [rbx + 4*reg] with r32 in {eax=0, ecx=1, edx=2, esi=6}.
+  void loadReg(uint8_t host, uint8_t reg) {
+    emit({0x8B, static_cast<uint8_t>(0x43 | (host << 3)), slot(reg)});
+  }
+
+  void storeEax(uint8_t reg) {
+    if (reg != 0)
+      emit({0x89, 0x43, slot(reg)});
+  }
+
+  void storeImm(uint8_t reg, uint32_t value) {
+    if (reg == 0)
+      return;
+    emit({0xC7, 0x43, slot(reg)});
+    emit32(value);
+  }
+
+  // Ends the block: rax = packed result, restore callee-saved and return.
+  void emitReturn(uint64_t packed) {
+    emit({0x48, 0xB8});
+    emit64(packed);
+    emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+  }
+
+  static uint64_t pack(uint32_t retired, uint32_t pc) {
+    return (static_cast<uint64_t>(retired) << 32) | pc;
+  }
+
+  // Conditional jump (0F 8x rel32) to an exit stub returning `packed`.
+  void jumpToExit(uint8_t condition, uint64_t packed) {
+    emit({0x0F, condition});
+    exits.push_back({code.size(), packed});
+    emit32(0);
+  }
+
+  void callHelper(const void *helper) {
+    emit({0x4C, 0x89, 0xE7}); // mov rdi, r12
+    emit({0x48, 0xB8});
+    emit64(reinterpret_cast<uint64_t>(helper));
+    emit({0xFF, 0xD0}); // call rax
+  }
+
+  void setFlag(uint8_t setcc, uint8_t rd) {
+    emit({0x0F, setcc, 0xC0});       // setcc al
+    emit({0x0F, 0xB6, 0xC0});        // movzx eax, al
+    storeEax(rd);
+  }
+
+  void emitDivide(const DecodedInstruction &inst) {
+    const bool isSigned = inst.op == Op::DIV || inst.op == Op::REM;
+    const bool wantsRemainder = inst.op == Op::REM || inst.op == Op::REMU;
+    loadReg(0, inst.rs1);
+    loadReg(1, inst.rs2);
+    emit({0x85, 0xC9}); // test ecx, ecx
+    emit({0x75, 0x00}); // jnz nonzero
+    size_t nonZero = code.size() - 1;
+    if (!wantsRemainder)
+      emit({0xB8, 0xFF, 0xFF, 0xFF, 0xFF}); // eax = -1
+    emit({0xE9});                           // jmp done
+    size_t zeroDone = code.size();
+    emit32(0);
+    code[nonZero] = static_cast<uint8_t>(code.size() - nonZero - 1);
+    size_t overflowDone = 0;
+    if (isSigned) {
+      emit({0x83, 0xF9, 0xFF}); // cmp ecx, -1
+      emit({0x75, 0x00});       // jne divide
+      size_t notMinusOne = code.size() - 1;
+      emit({0x3D, 0x00, 0x00, 0x00, 0x80}); // cmp eax, INT32_MIN
+      emit({0x75, 0x00});                   // jne divide
+      size_t notMin = code.size() - 1;
+      if (wantsRemainder)
+        emit({0x31, 0xC0}); // eax = 0, quotient stays INT32_MIN
+      emit({0xE9});
+      overflowDone = code.size();
+      emit32(0);
+      code[notMinusOne] = static_cast<uint8_t>(code.size() - notMinusOne - 1);
+      code[notMin] = static_cast<uint8_t>(code.size() - notMin - 1);
+      emit({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+    } else {
+      emit({0x31, 0xD2, 0xF7, 0xF1}); // xor edx, edx; div ecx
+    }
+    if (wantsRemainder)
+      emit({0x89, 0xD0}); // mov eax, edx
+    const size_t done = code.size();
+    auto patch = [&](size_t at) {
+      const uint32_t rel = static_cast<uint32_t>(done - (at + 4));
+      for (int i = 0; i < 4; ++i)
+        code[at + i] = static_cast<uint8_t>(rel >> (8 * i));
+    };
+    patch(zeroDone);
+    if (isSigned)
+      patch(overflowDone);
+    storeEax(inst.rd);
+  }
+
+  // Emits one instruction; returns false if it must be left to the
+  // interpreter (CSR, SYSTEM and trapping encodings).
+  bool emitInstruction(const DecodedInstruction &inst, uint32_t pc,
+                       uint32_t index) {
+    const uint8_t rd = inst.rd;
+    const uint32_t imm = static_cast<uint32_t>(inst.imm);
+    auto aluImm = [&](uint8_t opcode) {
+      if (rd == 0)
+        return;
+      loadReg(0, inst.rs1);
+      emit({opcode});
+      emit32(imm);
+      storeEax(rd);
+    };
+    auto aluReg = [&](uint8_t opcode) {
+      if (rd == 0)
+        return;
+      loadReg(0, inst.rs1);
+      emit({opcode, 0x43, slot(inst.rs2)});
+      storeEax(rd);
+    };
+    auto shiftImm = [&](uint8_t modrm) {
+      if (rd == 0)
+        return;
+      loadReg(0, inst.rs1);
+      emit({0xC1, modrm, static_cast<uint8_t>(imm & 0x1F)});
+      storeEax(rd);
+    };
+    auto shiftReg = [&](uint8_t modrm) {
+      if (rd == 0)
+        return;
+      loadReg(0, inst.rs1);
+      loadReg(1, inst.rs2);
+      emit({0xD3, modrm});
+      storeEax(rd);
+    };
+    auto mulHigh = [&](bool signedA, bool signedB, bool arithmetic) {
+      if (rd == 0)
+        return;
+      if (signedA)
+        emit({0x48, 0x63, 0x43, slot(inst.rs1)}); // movsxd rax, [rs1]
+      else
+        loadReg(0, inst.rs1);
+      if (signedB)
+        emit({0x48, 0x63, 0x4B, slot(inst.rs2)}); // movsxd rcx, [rs2]
+      else
+        loadReg(1, inst.rs2);
+      emit({0x48, 0x0F, 0xAF, 0xC1}); // imul rax, rcx
+      emit({0x48, 0xC1, static_cast<uint8_t>(arithmetic ? 0xF8 : 0xE8),
+            0x20}); // sar/shr rax, 32
+      storeEax(rd);
+    };
+    auto branch = [&](uint8_t condition) {
+      loadReg(0, inst.rs1);
+      emit({0x3B, 0x43, slot(inst.rs2)}); // cmp eax, [rs2]
+      jumpToExit(condition, pack(index + 1, pc + inst.imm));
+      emitReturn(pack(index + 1, pc + 4));
+    };
+
+    switch (inst.op) {
+    case Op::NOP:
+      break;
+    case Op::LUI:
+      storeImm(rd, imm);
+      break;
+    case Op::AUIPC:
+      storeImm(rd, pc + imm);
+      break;
+    case Op::ADDI:
+      aluImm(0x05);
+      break;
+    case Op::ANDI:
+      aluImm(0x25);
+      break;
+    case Op::ORI:
+      aluImm(0x0D);
+      break;
+    case Op::XORI:
+      aluImm(0x35);
+      break;
+    case Op::SLTI:
+    case Op::SLTIU:
+      if (rd == 0)
+        break;
+      loadReg(0, inst.rs1);
+      emit({0x3D});
+      emit32(imm);
+      setFlag(inst.op == Op::SLTI ? 0x9C : 0x92, rd);
+      break;
+    case Op::SLLI:
+      shiftImm(0xE0);
+      break;
+    case Op::SRLI:
+      shiftImm(0xE8);
+      break;
+    case Op::SRAI:
+      shiftImm(0xF8);
+      break;
+    case Op::ADD:
+      aluReg(0x03);
+      break;
+    case Op::SUB:
+      aluReg(0x2B);
+      break;
+    case Op::AND:
+      aluReg(0x23);
+      break;
+    case Op::OR:
+      aluReg(0x0B);
+      break;
+    case Op::XOR:
+      aluReg(0x33);
+      break;
+    case Op::SLT:
+    case Op::SLTU:
+      if (rd == 0)
+        break;
+      loadReg(0, inst.rs1);
+      emit({0x3B, 0x43, slot(inst.rs2)});
+      setFlag(inst.op == Op::SLT ? 0x9C : 0x92, rd);
+      break;
+    case Op::SLL:
+      shiftReg(0xE0);
+      break;
+    case Op::SRL:
+      shiftReg(0xE8);
+      break;
+    case Op::SRA:
+      shiftReg(0xF8);
+      break;
+    case Op::MUL:
+      if (rd == 0)
+        break;
+      loadReg(0, inst.rs1);
+      emit({0x0F, 0xAF, 0x43, slot(inst.rs2)}); // imul eax, [rs2]
+      storeEax(rd);
+      break;
+    case Op::MULH:
+      mulHigh(true, true, true);
+      break;
+    case Op::MULHSU:
+      mulHigh(true, false, true);
+      break;
+    case Op::MULHU:
+      mulHigh(false, false, false);
+      break;
+    case Op::DIV:
+    case Op::DIVU:
+    case Op::REM:
+    case Op::REMU:
+      if (rd != 0)
+        emitDivide(inst);
+      break;
+    case Op::LB:
+    case Op::LH:
+    case Op::LW:
+    case Op::LBU:
+    case Op::LHU:
+      loadReg(6, inst.rs1);
+      emit({0x81, 0xC6}); // add esi, imm32
+      emit32(imm);
+      emit({0xBA}); // mov edx, op
+      emit32(static_cast<uint32_t>(inst.op));
+      emit({0xB9}); // mov ecx, pc
+      emit32(pc);
+      callHelper(reinterpret_cast<const void *>(&jitLoad));
+      emit({0x48, 0x85, 0xC0}); // test rax, rax
+      jumpToExit(0x88, pack(index, pc));
+      storeEax(rd);
+      break;
+    case Op::SB:
+    case Op::SH:
+    case Op::SW:
+      loadReg(6, inst.rs1);
+      emit({0x81, 0xC6});
+      emit32(imm);
+      loadReg(2, inst.rs2);
+      emit({0xB9}); // mov ecx, op
+      emit32(static_cast<uint32_t>(inst.op));
+      emit({0x41, 0xB8}); // mov r8d, pc
+      emit32(pc);
+      callHelper(reinterpret_cast<const void *>(&jitStore));
+      emit({0x83, 0xF8, 0x01}); // cmp eax, 1
+      jumpToExit(0x84, pack(index, pc));
+      jumpToExit(0x87, pack(index + 1, pc + 4));
+      break;
+    case Op::BEQ:
+      branch(0x84);
+      break;
+    case Op::BNE:
+      branch(0x85);
+      break;
+    case Op::BLT:
+      branch(0x8C);
+      break;
+    case Op::BGE:
+      branch(0x8D);
+      break;
+    case Op::BLTU:
+      branch(0x82);
+      break;
+    case Op::BGEU:
+      branch(0x83);
+      break;
+    case Op::BRANCH_INVALID:
+      emitReturn(pack(index + 1, pc + 4));
+      break;
+    case Op::JAL:
+      storeImm(rd, pc + 4);
+      emitReturn(pack(index + 1, pc + inst.imm));
+      break;
+    case Op::JALR:
+      loadReg(0, inst.rs1);
+      emit({0x05});
+      emit32(imm);
+      emit({0x83, 0xE0, 0xFE}); // and eax, ~1
+      storeImm(rd, pc + 4);
+      emit({0x48, 0xBA}); // mov rdx, retired << 32
+      emit64(pack(index + 1, 0));
+      emit({0x48, 0x09, 0xD0}); // or rax, rdx
+      emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+      break;
+    default:
+      return false;
+    }
+    return true;
+  }
+
+  // Sets the protection of the pages holding buffer[offset, offset + size).
+  // On failure the JIT is switched off: nothing more is compiled.
+  bool protect(size_t offset, size_t size, int protection) {
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t start = offset / page * page;
+    const size_t end = std::min(BUFFER_SIZE, (offset + size + page - 1) /
+                                                 page * page);
+    if (mprotect(buffer + start, end - start, protection) == 0)
+      return true;
+    munmap(buffer, BUFFER_SIZE);
+    buffer = nullptr;
+    disable(protection & PROT_EXEC
+                ? "mprotect to read/execute failed"
+                : "mprotect to read/write failed");
+    return false;
+  }
+
+  // Warns once that blocks run in the interpreter from now on.
+  void disable(const char *why) {
+    if (warned)
+      return;
+    warned = true;
+    std::cerr << "WARNING: --jit disabled, " << why
+              << "; blocks run in the interpreter." << std::endl;
+  }
+
+public:
+  uint64_t compiled = 0;
+
+  // The buffer is never writable and executable at once: it starts out
+  // read/write, and compile() hands the pages it wrote back read/execute,
+  // making them writable again only while it writes the next block.
+  Jit() {
+    void *mapping = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED)
+      buffer = static_cast<uint8_t *>(mapping);
+  }
+
+  ~Jit() {
+    if (buffer)
+      munmap(buffer, BUFFER_SIZE);
+  }
+
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  bool full() const { return used + MAX_BLOCK_CODE > BUFFER_SIZE; }
+
+  // Forgets all generated code; callers must drop their function pointers.
+  void reset() { used = 0; }
+
+  // Translates the longest prefix of `block` the backend supports. Returns
+  // the entry point, or nullptr if not even the first instruction compiles.
+  JitFunction compile(const Block &block, uint32_t &length) {
+    if (!buffer) {
+      disable("mmap of the code buffer failed");
+      return nullptr;
+    }
+    if (full())
+      return nullptr;
+    code.clear();
+    exits.clear();
+    emit({0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+    emit({0x48, 0x89, 0xFB});             // mov rbx, rdi
+    emit({0x49, 0x89, 0xF4});             // mov r12, rsi
+
+    length = 0;
+    bool terminated = false;
+    for (const DecodedInstruction &inst : block.ops) {
+      const uint32_t pc = block.startPc + 4 * length;
+      if (!emitInstruction(inst, pc, length))
+        break;
+      length++;
+      if (endsBlock(inst.op)) {
+        terminated = true;
+        break;
+      }
+    }
+    if (length == 0)
+      return nullptr;
+    if (!terminated)
+      emitReturn(pack(length, block.startPc + 4 * length));
+
+    for (const auto &exit : exits) {
+      const uint32_t rel =
+          static_cast<uint32_t>(code.size() - (exit.first + 4));
+      for (int i = 0; i < 4; ++i)
+        code[exit.first + i] = static_cast<uint8_t>(rel >> (8 * i));
+      emitReturn(exit.second);
+    }
+    if (code.size() > MAX_BLOCK_CODE)
+      return nullptr;
+
+    uint8_t *entry = buffer + used;
+    if (!protect(used, code.size(), PROT_READ | PROT_WRITE))
+      return nullptr;
+    std::memcpy(entry, code.data(), code.size());
+    if (!protect(used, code.size(), PROT_READ | PROT_EXEC))
+      return nullptr;
+    used += (code.size() + 15) & ~static_cast<size_t>(15);
+    compiled++;
+    return reinterpret_cast<JitFunction>(entry);
+  }
+};
+
+constexpr std::array<std::string_view, 32> x_label = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "s0", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+
+enum class Engine { SWITCH, THREADED, BLOCK, TIERED, AOT };
+
+// The part of the run that --trace=full or --trace=cache writes out. All of
+// these must hold for an instruction to be traced; outside the window it runs
+// under StatsTrace, so the caches and their statistics are the same as in an
+// unfiltered run.
+class TraceFilter {
+public:
+  uint64_t from = 0;
+  uint64_t to = UINT64_MAX;
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  bool trapWindow = false;
+
+  bool enabled() const {
+    return from != 0 || to != UINT64_MAX || perInstruction();
+  }
+
+  // An instruction-count window alone is applied by stopping the engine at
+  // its bounds; pc ranges and the trap window are checked per instruction.
+  bool perInstruction() const { return !ranges.empty() || trapWindow; }
+
+  bool covers(uint32_t pc) const {
+    if (ranges.empty())
+      return true;
+    for (const auto &range : ranges) {
+      if (pc >= range.first && pc < range.second)
+        return true;
+    }
+    return false;
+  }
+};
+
+// The number in arg[start, start + count) of a command-line option, in
+// `base` (0 also takes 0x and 0 prefixes). Exits with a FATAL message naming
+// the option unless the whole text is a number that fits in T.
+template <class T>
+T optionNumber(const std::string &arg, size_t start,
+               size_t count = std::string::npos, int base = 10) {
+  const std::string text = arg.substr(start, count);
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long long value = std::strtoull(text.c_str(), &end, base);
+  if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])) ||
+      *end || errno || value > std::numeric_limits<T>::max()) {
+    std::cerr << "FATAL: " << arg.substr(0, arg.find('='))
+              << " needs a number" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return static_cast<T>(value);
+}
+
+// An outer cache level given as --l2= or --l3=SETS:WAYS:LINE[:POLICY].
+// Outer levels write back and allocate on write misses.
+class LevelOption {
+public:
+  CacheGeometry geometry = DEFAULT_CACHE;
+  std::string policy = LruPolicy::NAME;
+  static constexpr WritePolicy WRITE = {WriteHit::BACK, WriteMiss::ALLOCATE};
+};
+
+class Options {
+public:
+  Engine engine = aotBlockCount ? Engine::AOT : Engine::SWITCH;
+  bool perf = false;
+  TraceMode trace = TraceMode::FULL;
+  bool packedTrace = false;
+  TraceFilter filter;
+  bool jit = false;
+  bool jitLockstep = false;
+  uint32_t jitThreshold = 16;
+  uint32_t tierThreshold = 4;
+  bool asyncOutput = false;
+  bool mappedOutput = false;
+  unsigned formatThreads = 0;
+  size_t formatChunk = 16384;
+  size_t ringSize = 16 << 20;
+  RingFull ringFull = RingFull::WAIT;
+  CacheGeometry iCache = DEFAULT_CACHE;
+  CacheGeometry dCache = DEFAULT_CACHE;
+  bool comparePolicies = false;
+  uint64_t policySeed = 1;
+  WritePolicy dWrite;
+  bool cacheTraffic = false;
+  bool missClasses = false;
+  uint64_t missInterval = 0;
+  size_t missTop = 10;
+  uint32_t reuseLine = 0;
+  std::vector<LevelOption> levels;
+  bool timing = false;
+  bool mtimeCycles = false;
+  CacheLatency l1Latency;
+  std::array<CacheLatency, 2> outerLatency = {{{8, 8}, {20, 20}}};
+  uint32_t dramLatency = 50;
+  std::string explore;
+  unsigned exploreThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::string accessTrace;
+  bool accessTraceDin = false;
+
+  Options(int argc, char *argv[]) {
+    for (int i = 5; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--engine=switch") {
+        engine = Engine::SWITCH;
+      } else if (arg == "--engine=threaded") {
+        engine = Engine::THREADED;
+      } else if (arg == "--engine=block") {
+        engine = Engine::BLOCK;
+      } else if (arg == "--engine=tiered") {
+        engine = Engine::TIERED;
+      } else if (arg.rfind("--tier-threshold=", 0) == 0) {
+        tierThreshold = optionNumber<uint32_t>(arg, 17);
+      } else if (arg == "--engine=aot") {
+        engine = Engine::AOT;
+      } else if (arg.rfind("--format-threads=", 0) == 0) {
+        formatThreads = optionNumber<unsigned>(arg, 17);
+      } else if (arg.rfind("--format-chunk=", 0) == 0) {
+        formatChunk = std::max<size_t>(1, optionNumber<size_t>(arg, 15));
+      } else if (arg == "--mmap-output") {
+        mappedOutput = true;
+      } else if (arg == "--async-output") {
+        asyncOutput = true;
+      } else if (arg.rfind("--ring-size=", 0) == 0) {
+        asyncOutput = true;
+        ringSize = optionNumber<uint32_t>(arg, 12);
+      } else if (arg == "--ring-full=wait") {
+        asyncOutput = true;
+        ringFull = RingFull::WAIT;
+      } else if (arg == "--ring-full=drop") {
+        asyncOutput = true;
+        ringFull = RingFull::DROP;
+      } else if (arg == "--perf") {
+        perf = true;
+      } else if (arg == "--trace=full") {
+        trace = TraceMode::FULL;
+      } else if (arg == "--trace=cache") {
+        trace = TraceMode::CACHE;
+      } else if (arg == "--trace=stats" || arg == "--no-trace") {
+        trace = TraceMode::STATS;
+      } else if (arg == "--trace=none") {
+        trace = TraceMode::NONE;
+      } else if (arg == "--trace=binary") {
+        trace = TraceMode::BINARY;
+        packedTrace = false;
+      } else if (arg == "--trace=packed") {
+        trace = TraceMode::BINARY;
+        packedTrace = true;
+      } else if (arg.rfind("--trace-from=", 0) == 0) {
+        filter.from = optionNumber<uint64_t>(arg, 13);
+      } else if (arg.rfind("--trace-to=", 0) == 0) {
+        filter.to = optionNumber<uint64_t>(arg, 11);
+      } else if (arg.rfind("--trace-pc=", 0) == 0) {
+        const size_t colon = arg.find(':', 11);
+        if (colon == std::string::npos) {
+          std::cerr << "FATAL: --trace-pc needs START:END" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        filter.ranges.emplace_back(
+            optionNumber<uint32_t>(arg, 11, colon - 11, 0),
+            optionNumber<uint32_t>(arg, colon + 1, std::string::npos, 0));
+      } else if (arg == "--trace-trap") {
+        filter.trapWindow = true;
+      } else if (arg.rfind("--icache=", 0) == 0) {
+        parseCache(arg, iCache);
+      } else if (arg.rfind("--dcache=", 0) == 0) {
+        parseCache(arg, dCache);
+      } else if (arg == "--dcache-write=through") {
+        dWrite.hit = WriteHit::THROUGH;
+      } else if (arg == "--dcache-write=back") {
+        dWrite.hit = WriteHit::BACK;
+      } else if (arg == "--dcache-write-miss=allocate") {
+        dWrite.miss = WriteMiss::ALLOCATE;
+      } else if (arg == "--dcache-write-miss=no-allocate") {
+        dWrite.miss = WriteMiss::NO_ALLOCATE;
+      } else if (arg.rfind("--l2=", 0) == 0 || arg.rfind("--l3=", 0) == 0) {
+        parseLevel(arg);
+      } else if (arg == "--cache-traffic") {
+        cacheTraffic = true;
+      } else if (arg == "--miss-classes") {
+        missClasses = true;
+      } else if (arg == "--miss-profile") {
+        missInterval = 10000;
+      } else if (arg.rfind("--miss-profile=", 0) == 0) {
+        missInterval = std::max<uint64_t>(1, optionNumber<uint64_t>(arg, 15));
+      } else if (arg.rfind("--miss-top=", 0) == 0) {
+        missTop = optionNumber<size_t>(arg, 11);
+      } else if (arg == "--reuse-distance") {
+        reuseLine = DEFAULT_CACHE.lineBytes;
+      } else if (arg.rfind("--reuse-distance=", 0) == 0) {
+        reuseLine = optionNumber<uint32_t>(arg, 17);
+        if (!CacheGeometry::powerOfTwo(reuseLine)) {
+          std::cerr << "FATAL: --reuse-distance needs a power-of-two line "
+                       "size in bytes"
+                    << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      } else if (arg == "--timing") {
+        timing = true;
+      } else if (arg.rfind("--l1-latency=", 0) == 0) {
+        parseLatency(arg, l1Latency);
+      } else if (arg.rfind("--l2-latency=", 0) == 0) {
+        parseLatency(arg, outerLatency[0]);
+      } else if (arg.rfind("--l3-latency=", 0) == 0) {
+        parseLatency(arg, outerLatency[1]);
+      } else if (arg.rfind("--dram-latency=", 0) == 0) {
+        timing = true;
+        dramLatency = optionNumber<uint32_t>(arg, 15);
+      } else if (arg.rfind("--explore=", 0) == 0) {
+        explore = arg.substr(10);
+      } else if (arg.rfind("--explore-threads=", 0) == 0) {
+        exploreThreads = std::max(1u, optionNumber<unsigned>(arg, 18));
+      } else if (arg.rfind("--access-trace=", 0) == 0) {
+        accessTrace = arg.substr(15);
+      } else if (arg == "--access-trace-format=binary") {
+        accessTraceDin = false;
+      } else if (arg == "--access-trace-format=din") {
+        accessTraceDin = true;
+      } else if (arg == "--mtime=cycles") {
+        mtimeCycles = true;
+      } else if (arg == "--mtime=instructions") {
+        mtimeCycles = false;
+      } else if (arg == "--compare-policies") {
+        comparePolicies = true;
+      } else if (arg.rfind("--policy-seed=", 0) == 0) {
+        policySeed = optionNumber<uint64_t>(arg, 14, std::string::npos, 0);
+      } else if (arg == "--jit") {
+        jit = true;
+      } else if (arg == "--jit-lockstep") {
+        jit = true;
+        jitLockstep = true;
+      } else if (arg.rfind("--jit-threshold=", 0) == 0) {
+        jitThreshold = optionNumber<uint32_t>(arg, 16);
+      } else {
+        std::cerr << "Unknown option: " << arg << std::endl
+                  << "Options:" << std::endl
+                  << "  --engine=switch|threaded|block|tiered|aot"
+                  << std::endl
+                  << "  --tier-threshold=N" << std::endl
+                  << "  --async-output --ring-size=BYTES --ring-full=wait|drop"
+                  << std::endl
+                  << "  --mmap-output" << std::endl
+                  << "  --format-threads=N --format-chunk=RECORDS" << std::endl
+                  << "  --perf" << std::endl
+                  << "  --trace=full|cache|stats|none|binary|packed"
+                  << std::endl
+                  << "  --no-trace (same as --trace=stats)" << std::endl
+                  << "  --trace-from=N --trace-to=M --trace-pc=START:END "
+                     "--trace-trap"
+                  << std::endl
+                  << "  --jit --jit-lockstep --jit-threshold=N" << std::endl
+                  << "  --icache=SETS:WAYS:LINE --dcache=SETS:WAYS:LINE"
+                  << std::endl
+                  << "  --dcache-write=through|back "
+                     "--dcache-write-miss=allocate|no-allocate"
+                  << std::endl
+                  << "  --l2=SETS:WAYS:LINE[:POLICY] "
+                     "--l3=SETS:WAYS:LINE[:POLICY]"
+                  << std::endl
+                  << "  --cache-traffic --miss-classes" << std::endl
+                  << "  --miss-profile[=INSTRUCTIONS] --miss-top=N"
+                  << std::endl
+                  << "  --reuse-distance[=LINE]" << std::endl
+                  << "  --timing --l1-latency=HIT:MISS --l2-latency=HIT:MISS "
+                     "--l3-latency=HIT:MISS --dram-latency=N"
+                  << std::endl
+                  << "  --mtime=cycles|instructions" << std::endl
+                  << "  --explore=FILE --explore-threads=N" << std::endl
+                  << "  --access-trace=FILE --access-trace-format=binary|din"
+                  << std::endl
+                  << "  --compare-policies --policy-seed=N" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (jit && trace != TraceMode::STATS && trace != TraceMode::NONE) {
+      std::cerr << "FATAL: --jit needs --trace=stats or --trace=none: native "
+                   "blocks do not produce the instruction trace."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (jitThreshold == 0) {
+      std::cerr << "FATAL: --jit-threshold needs at least 1: blocks are "
+                   "compiled on their Nth execution."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (formatThreads > 0 &&
+        ((trace != TraceMode::FULL && trace != TraceMode::CACHE) ||
+         filter.enabled())) {
+      std::cerr << "FATAL: --format-threads needs --trace=full or "
+                   "--trace=cache, without trace filters."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (mtimeCycles &&
+        ((engine != Engine::SWITCH && engine != Engine::THREADED) || jit ||
+         trace == TraceMode::BINARY)) {
+      std::cerr << "FATAL: --mtime=cycles needs --engine=switch or threaded "
+                   "without --jit and a text trace: block engines advance "
+                   "mtime by whole blocks of instructions."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!explore.empty() &&
+        (trace == TraceMode::NONE || trace == TraceMode::BINARY)) {
+      std::cerr << "FATAL: --explore needs a text trace or --trace=stats."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (missInterval && jit) {
+      std::cerr << "FATAL: --miss-profile cannot be used with --jit: native "
+                   "blocks do not keep pc per instruction."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if ((!explore.empty() || !accessTrace.empty() || reuseLine) &&
+        jitLockstep) {
+      std::cerr << "FATAL: --explore, --access-trace and --reuse-distance "
+                   "cannot be used with --jit-lockstep, which runs blocks "
+                   "twice."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (mappedOutput && asyncOutput) {
+      std::cerr << "FATAL: --mmap-output and --async-output are exclusive."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (filter.enabled() && trace != TraceMode::FULL &&
+        trace != TraceMode::CACHE) {
+      std::cerr << "FATAL: trace filters need --trace=full or --trace=cache."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (filter.to <= filter.from) {
+      std::cerr << "FATAL: --trace-to must be after --trace-from."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    for (const auto &range : filter.ranges) {
+      if (range.second <= range.first) {
+        std::cerr << "FATAL: --trace-pc needs END after START." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (jit && engine != Engine::TIERED)
+      engine = Engine::BLOCK;
+    if (engine == Engine::AOT && aotBlockCount == 0) {
+      std::cerr << "FATAL: --engine=aot needs a binary built from the output "
+                   "of --translate."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+private:
+  void parseLevel(const std::string &arg) {
+    const size_t depth = arg[3] - '2';
+    if (levels.size() != depth) {
+      std::cerr << "FATAL: " << arg.substr(0, 4)
+                << (levels.size() > depth ? " given twice"
+                                          : " needs --l2 before it")
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    LevelOption level;
+    if (!parseCacheSpec(arg.substr(5), level.geometry, level.policy)) {
+      std::cerr << "FATAL: " << arg.substr(0, 4)
+                << " needs SETS:WAYS:LINE[:POLICY] with power-of-two sets "
+                   "and line bytes"
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    levels.push_back(level);
+  }
+
+  void parseLatency(const std::string &arg, CacheLatency &latency) {
+    const size_t colon = arg.find(':', 13);
+    if (colon == std::string::npos) {
+      std::cerr << "FATAL: " << arg.substr(0, 12) << " needs HIT:MISS"
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    latency.hit = optionNumber<uint32_t>(arg, 13, colon - 13);
+    latency.miss = optionNumber<uint32_t>(arg, colon + 1);
+    timing = true;
+  }
+
+  static void parseCache(const std::string &arg, CacheGeometry &geometry) {
+    if (!CacheGeometry::parse(arg.substr(9), geometry)) {
+      std::cerr << "FATAL: " << arg.substr(0, 8)
+                << " needs SETS:WAYS:LINE with power-of-two sets and line "
+                   "bytes (at least 4) and 1 to "
+                << CacheGeometry::MAX_WAYS << " ways" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+};
+
+class FormatPool;
+
+// The architectural state a replay of binary records starts from: memory,
+// registers, CSRs, devices and the caches with their counters.
+class HartState {
+public:
+  std::vector<uint8_t> mem;
+  std::array<uint32_t, 32> x;
+  Cache iCache;
+  Cache dCache;
+  std::vector<std::unique_ptr<CacheLevel>> levels;
+  uint32_t pc, mepc, mcause, mtvec, mtval, mstatus, mie, mip;
+  uint64_t mtime, mtimecmp;
+  uint32_t clintMsip;
+  uint32_t plicPendingReg, plicEnableReg, plicThresholdReg;
+  uint64_t instret;
+  bool mtimeCycles;
+  uint64_t retiredCycles;
+};
+
+class Hart {
+public:
+  Files &files;
+  std::vector<uint8_t> mem;
+  Cache iCache;
+  Cache dCache;
+  DecodeCache decodeCache;
+  BlockCache blockCache;
+  Jit jit;
+  bool jitEnabled = false;
+  bool jitLockstep = false;
+  uint32_t jitThreshold = 16;
+  Block *jitBlock = nullptr;
+  // Next pc of the running native block to be fetched through the i-cache.
+  uint32_t jitFetched = 0;
+  std::array<uint32_t, 32> lockstepX = {0};
+  std::vector<uint8_t> lockstepMem;
+  Cache lockstepICache;
+  Cache lockstepCache;
+  std::vector<std::unique_ptr<CacheLevel>> levels;
+  std::vector<std::unique_ptr<CacheLevel>> lockstepLevels;
+  std::vector<const AotBlock *> aotAt;
+  std::unique_ptr<PackedTraceWriter> packedTrace;
+  FormatPool *formatPool = nullptr;
+
+  bool run = true;
+  uint64_t stopAt = UINT64_MAX;
+  uint32_t pc = MemoryMap::OFFSET;
+  std::array<uint32_t, 32> x = {0};
+  uint32_t mepc = 0, mcause = 0, mtvec = 0, mtval = 0, mstatus = 0, mie = 0,
+           mip = 0;
+  uint64_t mtime = 0, mtimecmp = 0;
+  uint32_t clintMsip = 0;
+  uint32_t plicPendingReg = 0, plicEnableReg = 0, plicThresholdReg = 0;
+  uint64_t instret = 0;
+  // With mtimeCycles (--mtime=cycles) mtime advances by the cycles the
+  // caches spent since the last instruction retired, not by one.
+  bool mtimeCycles = false;
+  uint64_t retiredCycles = 0;
+
+  Hart(Files &f, size_t memSize, const CacheGeometry &iGeometry = DEFAULT_CACHE,
+       const CacheGeometry &dGeometry = DEFAULT_CACHE)
+      : files(f), mem(memSize),
+        iCache("i", f.output, iGeometry, AccessKind::FETCH),
+        dCache("d", f.output, dGeometry),
+        decodeCache(memSize), blockCache(mem), lockstepICache(iCache),
+        lockstepCache(dCache) {
+    loadMemory(files.input, MemoryMap::OFFSET, mem);
+  }
+
+  // Appends an outer cache level: the L2 behind both L1 caches, or the level
+  // behind the last one added.
+  void addLevel(std::unique_ptr<CacheLevel> level) {
+    level->connect(nullptr);
+    if (levels.empty()) {
+      iCache.connect(level.get());
+      dCache.connect(level.get());
+    } else {
+      levels.back()->connect(level.get());
+    }
+    levels.push_back(std::move(level));
+  }
+
+  // With `packed` the records that follow go through a PackedTraceWriter.
+  void writeTraceHeader(bool packed) {
+    TraceHeader header = {};
+    std::memcpy(header.magic,
+                packed ? TraceHeader::PACKED_MAGIC : TraceHeader::MAGIC,
+                sizeof(header.magic));
+    header.recordSize = sizeof(TraceRecord);
+    header.memoryBase = MemoryMap::OFFSET;
+    header.memorySize = mem.size();
+    const CacheGeometry &i = iCache.shape();
+    const CacheGeometry &d = dCache.shape();
+    header.iCache = {i.sets, i.ways, i.lineBytes};
+    header.dCache = {d.sets, d.ways, d.lineBytes};
+    header.dWriteHit = static_cast<uint8_t>(dCache.writePolicy().hit);
+    header.dWriteMiss = static_cast<uint8_t>(dCache.writePolicy().miss);
+    files.output.write(reinterpret_cast<const char *>(&header),
+                       sizeof(header));
+    files.output.write(reinterpret_cast<const char *>(mem.data()),
+                       mem.size());
+    if (packed)
+      packedTrace.reset(new PackedTraceWriter(files.output,
+                                              sizeof(header) + mem.size()));
+  }
+
+  // `retiring`: the instruction has not been retired yet, but will be.
+  void writeRecord(const TraceRecord &record, bool retiring);
+
+  void finishTrace() {
+    if (packedTrace)
+      packedTrace->finish();
+  }
+
+  // Record for a trap taken between instructions; pc is already the handler.
+  void recordTrap(RecordKind kind) {
+    writeRecord({mepc, 0, mcause, mtval, pc, 0, 0, kind, {}}, false);
+  }
+
+  HartState saveState() const {
+    std::vector<std::unique_ptr<CacheLevel>> savedLevels;
+    for (const auto &level : levels)
+      savedLevels.push_back(level->clone());
+    return {mem,   x,     iCache,   dCache,    std::move(savedLevels),
+            pc,    mepc,  mcause,   mtvec,     mtval,
+            mstatus, mie, mip,      mtime,     mtimecmp,
+            clintMsip, plicPendingReg, plicEnableReg, plicThresholdReg,
+            instret, mtimeCycles, retiredCycles};
+  }
+
+  // Outer levels missing here are added as copies of the saved ones.
+  void loadState(const HartState &state) {
+    mem = state.mem;
+    x = state.x;
+    iCache = state.iCache;
+    dCache = state.dCache;
+    for (size_t i = 0; i < state.levels.size(); ++i) {
+      if (i < levels.size())
+        levels[i]->restore(*state.levels[i]);
+      else
+        addLevel(state.levels[i]->clone());
+    }
+    pc = state.pc;
+    mepc = state.mepc;
+    mcause = state.mcause;
+    mtvec = state.mtvec;
+    mtval = state.mtval;
+    mstatus = state.mstatus;
+    mie = state.mie;
+    mip = state.mip;
+    mtime = state.mtime;
+    mtimecmp = state.mtimecmp;
+    clintMsip = state.clintMsip;
+    plicPendingReg = state.plicPendingReg;
+    plicEnableReg = state.plicEnableReg;
+    plicThresholdReg = state.plicThresholdReg;
+    instret = state.instret;
+    mtimeCycles = state.mtimeCycles;
+    retiredCycles = state.retiredCycles;
+  }
+
+  void updateMip() {
+    if (clintMsip > 0) {
+      mip |= (1 << 3);
+    } else {
+      mip &= ~(1 << 3);
+    }
+
+    if (mtime >= mtimecmp) {
+      mip |= (1 << 7);
+    } else {
+      mip &= ~(1 << 7);
+    }
+
+    uint32_t plicPendingAndEnabled = plicPendingReg & plicEnableReg;
+    if (plicPendingAndEnabled) {
+      mip |= (1 << 11);
+    } else {
+      mip &= ~(1 << 11);
+    }
+  }
+
+  // Returns true when an interrupt was taken and pc now points at its handler.
+  template <class Trace> bool takeInterrupt() {
+    updateMip();
+
+    uint32_t pendingAndEnabled = mip & mie;
+    uint32_t globalInterruptEnable = (mstatus >> 3) & 1;
+
+    if (globalInterruptEnable && pendingAndEnabled != 0) {
+      if (pendingAndEnabled & (1 << 11)) { // External Interrupt
+        triggerException(0x8000000b, 0, pc, mepc, mcause, mtvec, mtval,
+                         mstatus);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << ">interrupt:external              cause="
+                       << hex_format(mcause, 8)
+                       << ",epc=" << hex_format(mepc, 8)
+                       << ",tval=" << hex_format(mtval, 8) << '\n';
+        if constexpr (Trace::RECORDS)
+          recordTrap(RecordKind::INTERRUPT);
+        return true;
+      }
+      if (pendingAndEnabled & (1 << 7)) { // Timer Interrupt
+        triggerException(0x80000007, 0, pc, mepc, mcause, mtvec, mtval,
+                         mstatus);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << ">interrupt:timer                 cause="
+                       << hex_format(mcause, 8)
+                       << ",epc=" << hex_format(mepc, 8)
+                       << ",tval=" << hex_format(mtval, 8) << '\n';
+        if constexpr (Trace::RECORDS)
+          recordTrap(RecordKind::INTERRUPT);
+        return true;
+      }
+      if (pendingAndEnabled & (1 << 3)) { // Software Interrupt
+        triggerException(0x80000003, 0, pc, mepc, mcause, mtvec, mtval,
+                         mstatus);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << ">interrupt:software              cause="
+                       << hex_format(mcause, 8)
+                       << ",epc=" << hex_format(mepc, 8)
+                       << ",tval=" << hex_format(mtval, 8) << '\n';
+        if constexpr (Trace::RECORDS)
+          recordTrap(RecordKind::INTERRUPT);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns true when pc is outside RAM and an instruction fault was raised.
+  template <class Trace> bool fetchFault() {
+    if ((pc < MemoryMap::OFFSET) ||
+        (pc >= (MemoryMap::OFFSET + mem.size() - 3))) {
+      triggerException(1, pc, pc, mepc, mcause, mtvec, mtval, mstatus);
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << ">exception:instruction_fault     cause="
+                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
+                     << ",tval=" << hex_format(pc, 8) << '\n';
+      if constexpr (Trace::RECORDS)
+        recordTrap(RecordKind::FETCH_FAULT);
+      return true;
+    }
+    return false;
+  }
+
+  template <class Trace> const DecodedInstruction &fetch() {
+    return decodeCache.lookup(pc, iCache.read<Trace>(pc, mem));
+  }
+
+  void retire() {
+    pc += 4;
+    if (mtimeCycles) {
+      const uint64_t now = cycles();
+      mtime += now - retiredCycles;
+      retiredCycles = now;
+    } else {
+      mtime++;
+    }
+    instret++;
+  }
+
+  // Every instruction is fetched through the i-cache, so the cycles of the
+  // run are those of all fetches plus those of all loads and stores.
+  uint64_t cycles() const { return iCache.cycles() + dCache.cycles(); }
+
+  bool interruptsEnabled() const { return (mstatus & (1 << 3)) && mie != 0; }
+
+  // The engines return once ebreak stops the hart or instret reaches stopAt.
+  bool running() const { return run && instret < stopAt; }
+
+  // Instructions that can retire before the timer interrupt becomes pending
+  // or the run reaches stopAt.
+  uint64_t timerBudget() const {
+    const uint64_t untilStop = stopAt > instret ? stopAt - instret : 0;
+    if (!(mstatus & (1 << 3)) || !(mie & (1 << 7)))
+      return untilStop;
+    return std::min(untilStop, mtimecmp > mtime ? mtimecmp - mtime : 0);
+  }
+
+  bool inRam(uint32_t address) const {
+    return address >= MemoryMap::OFFSET &&
+           address < (MemoryMap::OFFSET + mem.size());
+  }
+
+  void invalidateCode(uint32_t address, uint32_t size) {
+    decodeCache.invalidate(address, size);
+    blockCache.invalidate(address, size);
+  }
+
+  template <class Trace, Op O> bool execute(const DecodedInstruction &inst);
+  template <class Trace, Op O> bool perform(const DecodedInstruction &inst);
+  template <class Trace> bool dispatch(const DecodedInstruction &inst);
+  template <class Trace> Block *runBlock(Block &block);
+  bool fetchMatches(const Block &block) const;
+  void checkLockstep(Block &block, uint32_t retired);
+
+  // Fetches the words of the running native block from jitFetched up to
+  // `end`. The load and store helpers call it first, so every fetch reaches
+  // the caches where the interpreter would make it: after the accesses of
+  // the instructions before it and before those of its own.
+  template <class Trace> void fetchNative(uint32_t end) {
+    for (; jitFetched < end; jitFetched += 4)
+      iCache.read<Trace>(jitFetched, mem);
+  }
+  template <class Trace> Block *runCompiled(Block &block);
+  template <class Trace> Block *enterBlock(Block &block);
+  template <class Trace, Op O>
+  bool aotStep(const DecodedInstruction &inst, uint64_t index,
+               uint64_t budget);
+
+  // How one step of the switch engine left pc.
+  enum class Step { NEXT, TRAP, MRET };
+
+  template <class Trace> Step step();
+  template <class Trace> void runSwitch();
+  template <class Trace> void runThreaded();
+  template <class Trace> void runBlocks();
+  template <class Trace> void runCold();
+  template <class Trace> void runTiered();
+  template <class Trace> void runAot();
+  template <class Trace> void simulate(Engine engine);
+  template <class Trace> const char *replay(const TraceRecord &record);
+  template <class Trace> void runWindow(const TraceFilter &filter);
+  template <class Trace>
+  void simulate(Engine engine, const TraceFilter &filter);
+
+  void printTiming() {
+    const double cpi = instret ? static_cast<double>(cycles()) / instret : 0;
+    files.output << "#timing:cycles                  cycles=" << cycles()
+                 << ",instructions=" << instret
+                 << ",cpi=" << fixed_format(cpi, 4) << '\n';
+    dCache.printTiming();
+    iCache.printTiming();
+    for (const auto &level : levels)
+      level->printTiming(files.output);
+  }
+
+  void printTierStats() {
+    files.output << "#tier:block                     promoted="
+                 << blockCache.built << ",demoted=" << blockCache.invalidated
+                 << '\n';
+    files.output << "#tier:native                    promoted=" << jit.compiled
+                 << ",demoted=" << blockCache.nativeDemoted << '\n';
+  }
+};
+
+// Executes one instruction and returns false when it trapped or redirected pc
+// itself. Under the binary trace policy this also writes its TraceRecord.
+template <class Trace, Op O>
+bool Hart::execute(const DecodedInstruction &inst) {
+  if constexpr (!Trace::RECORDS) {
+    return perform<Trace, O>(inst);
+  } else {
+    TraceRecord record = {pc, inst.raw, 0, 0, 0, iCache.lastAccess, 0,
+                          RecordKind::INSTRUCTION, {}};
+    if constexpr (isLoad(O) || isStore(O))
+      record.address = x[inst.rs1] + inst.imm;
+    dCache.lastAccess = 0;
+    const bool retired = perform<Trace, O>(inst);
+    record.dCache = dCache.lastAccess;
+    record.nextPc = retired ? pc + 4 : pc;
+    if (retired) {
+      record.value = x[inst.rd];
+    } else if constexpr (O != Op::MRET) {
+      record.kind = RecordKind::EXCEPTION;
+      record.value = mcause;
+      record.address = mtval;
+    }
+    writeRecord(record, retired);
+    return retired;
+  }
+}
+
+template <class Trace, Op O>
+bool Hart::perform(const DecodedInstruction &inst) {
+  const uint8_t rs1 = inst.rs1;
+  const uint8_t rs2 = inst.rs2;
+  const uint8_t rd = inst.rd;
+
+  if constexpr (O == Op::NOP) {
+    return true;
+  } else if constexpr (O == Op::SLLI) {
+    const uint32_t uimm = inst.imm;
+    const uint32_t data = x[rs1] << uimm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":slli   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << uimm << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "<<"
+                   << uimm << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::ADDI) {
+    const int32_t simm = inst.imm;
+    const int32_t data = simm + static_cast<int32_t>(x[rs1]);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":addi   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
+                   << "+" << hex_format(simm, 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::ANDI) {
+    const uint32_t simm = inst.imm;
+    const uint32_t data = x[rs1] & simm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":andi   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
+                   << "&" << hex_format(simm, 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::ORI) {
+    const uint32_t simm = inst.imm;
+    const uint32_t data = x[rs1] | simm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":ori    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
+                   << "|" << hex_format(simm, 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::XORI) {
+    const uint32_t simm = inst.imm;
+    const uint32_t data = x[rs1] ^ simm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":xori   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
+                   << "^" << hex_format(simm, 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SLTI) {
+    const int32_t simm = inst.imm;
+    const uint32_t data = (static_cast<int32_t>(x[rs1]) < simm) ? 1 : 0;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":slti   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "     " << x_label[rd] << "=(" << hex_format(x[rs1], 8)
+                   << "<" << hex_format(simm, 8) << ")=" << data
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SLTIU) {
+    const uint32_t simm = inst.imm;
+    const uint32_t data = (x[rs1] < simm) ? 1 : 0;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":sltiu  " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "     " << x_label[rd] << "=(" << hex_format(x[rs1], 8)
+                   << "<" << hex_format(simm, 8) << ")=" << data
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SRLI) {
+    const uint32_t uimm = inst.imm;
+    const uint32_t data = x[rs1] >> uimm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":srli   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << uimm << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>"
+                   << uimm << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SRAI) {
+    const uint32_t uimm = inst.imm;
+    const uint32_t data = static_cast<int32_t>(x[rs1]) >> uimm;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":srai   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << uimm << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>>"
+                   << uimm << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::LUI) {
+    const uint32_t immU = inst.imm;
+    const uint32_t data = immU;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":lui    " << x_label[rd] << ","
+                   << hex_format(immU >> 12, 5) << "         " << x_label[rd]
+                   << "=" << hex_format(data, 8) << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::AUIPC) {
+    const uint32_t immU = inst.imm;
+    const uint32_t data = immU + pc;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":auipc  " << x_label[rd] << ","
+                   << hex_format(immU >> 12, 5) << "       " << x_label[rd]
+                   << "=" << hex_format(pc, 8) << "+" << hex_format(immU, 8)
+                   << "=" << hex_format(data, 8) << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (isLoad(O)) {
+    const int32_t simm = inst.imm;
+    const uint32_t address = x[rs1] + simm;
+    uint32_t data = 0;
+    bool handled = true;
+    std::string_view mnemonic = ":lw     ";
+
+    if (address >= MemoryMap::OFFSET &&
+        address < (MemoryMap::OFFSET + mem.size())) {
+      uint32_t wordData = dCache.read<Trace>(address, mem);
+      uint32_t byteOffset = address & 0x3;
+
+      if constexpr (O == Op::LB) {
+        data = static_cast<int8_t>(wordData >> (byteOffset * 8));
+        mnemonic = ":lb     ";
+      } else if constexpr (O == Op::LH) {
+        data = static_cast<int16_t>(wordData >> (byteOffset * 8));
+        mnemonic = ":lh     ";
+      } else if constexpr (O == Op::LW) {
+        data = wordData;
+      } else if constexpr (O == Op::LBU) {
+        data = (wordData >> (byteOffset * 8)) & 0xFF;
+        mnemonic = ":lbu    ";
+      } else if constexpr (O == Op::LHU) {
+        data = (wordData >> (byteOffset * 8)) & 0xFFFF;
+        mnemonic = ":lhu    ";
+      } else {
+        handled = false;
+      }
+    } else {
+      if (address == MemoryMap::CLINT_MSIP) {
+        data = clintMsip;
+      } else if (address == MemoryMap::CLINT_MTIMECMP) {
+        data = static_cast<uint32_t>(mtimecmp);
+      } else if (address == MemoryMap::CLINT_MTIMECMP + 4) {
+        data = static_cast<uint32_t>(mtimecmp >> 32);
+      } else if (address == MemoryMap::CLINT_MTIME) {
+        data = static_cast<uint32_t>(mtime);
+      } else if (address == MemoryMap::CLINT_MTIME + 4) {
+        data = static_cast<uint32_t>(mtime >> 32);
+      } else if (address ==
+                 MemoryMap::PLIC_ENABLE + (MemoryMap::UART_IRQ / 32) * 4) {
+        data = plicEnableReg;
+      } else if (address ==
+                 MemoryMap::PLIC_PENDING + (MemoryMap::UART_IRQ / 32) * 4) {
+        data = plicPendingReg;
+      } else if (address == MemoryMap::PLIC_THRESHOLD) {
+        data = plicThresholdReg;
+      } else if (address == MemoryMap::PLIC_CLAIM) {
+        data = ((plicPendingReg & plicEnableReg) & (1 << MemoryMap::UART_IRQ))
+                   ? MemoryMap::UART_IRQ
+                   : 0;
+      } else if (address == MemoryMap::UART_BASE + 2) {
+        data = 1;
+      } else {
+        handled = false;
+      }
+    }
+
+    if (handled) {
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << mnemonic << x_label[rd] << ","
+                     << hex_format(simm & 0xFFF, 3) << "(" << x_label[rs1]
+                     << ")      " << x_label[rd] << "=mem["
+                     << hex_format(address, 8) << "]=" << hex_format(data, 8)
+                     << '\n';
+      loadRd(data, rd, x);
+    } else {
+      triggerException(5, address, pc, mepc, mcause, mtvec, mtval, mstatus);
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << ">exception:load_fault               cause="
+                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
+                     << ",tval=" << hex_format(mtval, 8) << '\n';
+      return false;
+    }
+    return true;
+  } else if constexpr (isStore(O)) {
+    const int32_t simm = inst.imm;
+    const uint32_t address = x[rs1] + simm;
+    const uint32_t data = x[rs2];
+    const uint8_t funct3 = (inst.raw >> 12) & 0x07;
+    bool handled = true;
+
+    if (address >= MemoryMap::OFFSET &&
+        address < (MemoryMap::OFFSET + mem.size())) {
+      dCache.write<Trace>(address, data, funct3, mem);
+      if constexpr (O == Op::SB) {
+        invalidateCode(address, 1);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << hex_format(pc, 8) << ":sb     " << x_label[rs2] << ","
+                       << hex_format(simm & 0xFFF, 3) << "(" << x_label[rs1]
+                       << ")      mem[" << hex_format(address, 8)
+                       << "]=" << hex_format(data & 0xFF, 2) << '\n';
+      } else if constexpr (O == Op::SH) {
+        invalidateCode(address, 2);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << hex_format(pc, 8) << ":sh     " << x_label[rs2] << ","
+                       << hex_format(simm & 0xFFF, 3) << "(" << x_label[rs1]
+                       << ")      mem[" << hex_format(address, 8)
+                       << "]=" << hex_format(data & 0xFFFF, 4) << '\n';
+      } else if constexpr (O == Op::SW) {
+        invalidateCode(address, 4);
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << hex_format(pc, 8) << ":sw     " << x_label[rs2] << ","
+                       << hex_format(simm & 0xFFF, 3) << "(" << x_label[rs1]
+                       << ")      mem[" << hex_format(address, 8)
+                       << "]=" << hex_format(data, 8) << '\n';
+      } else {
+        handled = false;
+      }
+    } else {
+      if (address == MemoryMap::CLINT_MSIP) {
+        clintMsip = data & 0x1;
+      } else if (address == MemoryMap::CLINT_MTIMECMP) {
+        mtimecmp = (mtimecmp & 0xFFFFFFFF00000000) | data;
+      } else if (address == MemoryMap::CLINT_MTIMECMP + 4) {
+        mtimecmp = (mtimecmp & 0x00000000FFFFFFFF) |
+                   (static_cast<uint64_t>(data) << 32);
+      } else if (address == MemoryMap::CLINT_MTIME) {
+        mtime = (mtime & 0xFFFFFFFF00000000) | data;
+      } else if (address == MemoryMap::CLINT_MTIME + 4) {
+        mtime = (mtime & 0x00000000FFFFFFFF) |
+                (static_cast<uint64_t>(data) << 32);
+      } else if (address == MemoryMap::UART_TX_REG) {
+        files.terminalOutput << static_cast<char>(data);
+        plicPendingReg |= (1 << MemoryMap::UART_IRQ);
+      } else if (address ==
+                 MemoryMap::PLIC_ENABLE + (MemoryMap::UART_IRQ / 32) * 4) {
+        plicEnableReg = data;
+      } else if (address == MemoryMap::PLIC_THRESHOLD) {
+        plicThresholdReg = data;
+      } else if (address == MemoryMap::PLIC_CLAIM) {
+        if (data == MemoryMap::UART_IRQ)
+          plicPendingReg &= ~(1 << MemoryMap::UART_IRQ);
+      } else {
+        handled = false;
+      }
+      if (handled)
+        if constexpr (Trace::INSTRUCTIONS)
+          files.output << hex_format(pc, 8) << ":sw     " << x_label[rs2] << ","
+                       << hex_format(simm & 0xFFF, 3) << "(" << x_label[rs1]
+                       << ")      mem[" << hex_format(address, 8)
+                       << "]=" << hex_format(data, 8) << '\n';
+    }
+
+    if (!handled) {
+      triggerException(7, address, pc, mepc, mcause, mtvec, mtval, mstatus);
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << ">exception:store_fault              cause="
+                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
+                     << ",tval=" << hex_format(mtval, 8) << '\n';
+      return false;
+    }
+    return true;
+  } else if constexpr (O == Op::ADD) {
+    const uint32_t data = x[rs1] + x[rs2];
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":add    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "+"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SUB) {
+    const uint32_t data = x[rs1] - x[rs2];
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":sub    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "-"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::XOR) {
+    const uint32_t data = x[rs1] ^ x[rs2];
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":xor    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "^"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::OR) {
+    const uint32_t data = x[rs1] | x[rs2];
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":or     " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "|"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::AND) {
+    const uint32_t data = x[rs1] & x[rs2];
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":and    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "&"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SLT) {
+    const uint32_t data =
+        (static_cast<int32_t>(x[rs1]) < static_cast<int32_t>(x[rs2])) ? 1 : 0;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":slt    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "     "
+                   << x_label[rd] << "=(" << hex_format(x[rs1], 8) << "<"
+                   << hex_format(x[rs2], 8) << ")=" << data
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SLTU) {
+    const uint32_t data = (x[rs1] < x[rs2]) ? 1 : 0;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":sltu   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "     "
+                   << x_label[rd] << "=(" << hex_format(x[rs1], 8) << "<"
+                   << hex_format(x[rs2], 8) << ")=" << data
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SLL) {
+    const uint32_t shift = x[rs2] & 0x1F;
+    const uint32_t data = x[rs1] << shift;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":sll    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "<<"
+                   << shift << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SRL) {
+    const uint32_t shift = x[rs2] & 0x1F;
+    const uint32_t data = x[rs1] >> shift;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":srl    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>"
+                   << shift << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::SRA) {
+    const uint32_t shift = x[rs2] & 0x1F;
+    const int32_t data = static_cast<int32_t>(x[rs1]) >> shift;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":sra    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>>"
+                   << shift << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::MUL) {
+    const int64_t product =
+        static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
+        static_cast<int64_t>(static_cast<int32_t>(x[rs2]));
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":mul    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
+                   << hex_format(x[rs2], 8) << "="
+                   << hex_format(static_cast<uint32_t>(product), 8)
+                   << '\n';
+    loadRd(static_cast<uint32_t>(product), rd, x);
+    return true;
+  } else if constexpr (O == Op::MULH) {
+    const int64_t product =
+        static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
+        static_cast<int64_t>(static_cast<int32_t>(x[rs2]));
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":mulh   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
+                   << hex_format(x[rs2], 8) << "="
+                   << hex_format(static_cast<uint32_t>(product >> 32), 8)
+                   << '\n';
+    loadRd(static_cast<uint32_t>(product >> 32), rd, x);
+    return true;
+  } else if constexpr (O == Op::MULHSU) {
+    const int64_t product =
+        static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
+        static_cast<uint64_t>(x[rs2]);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":mulhsu " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
+                   << hex_format(x[rs2], 8) << "="
+                   << hex_format(static_cast<uint32_t>(product >> 32), 8)
+                   << '\n';
+    loadRd(static_cast<uint32_t>(product >> 32), rd, x);
+    return true;
+  } else if constexpr (O == Op::MULHU) {
+    const uint64_t product =
+        static_cast<uint64_t>(x[rs1]) * static_cast<uint64_t>(x[rs2]);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":mulhu  " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
+                   << hex_format(x[rs2], 8) << "="
+                   << hex_format(static_cast<uint32_t>(product >> 32), 8)
+                   << '\n';
+    loadRd(static_cast<uint32_t>(product >> 32), rd, x);
+    return true;
+  } else if constexpr (O == Op::DIV) {
+    int32_t dividend = x[rs1];
+    int32_t divisor = x[rs2];
+    int32_t data;
+    if (divisor == 0)
+      data = -1;
+    else if (dividend == INT32_MIN && divisor == -1)
+      data = INT32_MIN;
+    else
+      data = dividend / divisor;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":div    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "/"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::DIVU) {
+    uint32_t dividend = x[rs1];
+    uint32_t divisor = x[rs2];
+    uint32_t data = (divisor == 0) ? UINT32_MAX : dividend / divisor;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":divu   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "/"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::REM) {
+    int32_t dividend = x[rs1];
+    int32_t divisor = x[rs2];
+    int32_t data;
+    if (divisor == 0)
+      data = dividend;
+    else if (dividend == INT32_MIN && divisor == -1)
+      data = 0;
+    else
+      data = dividend % divisor;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":rem    " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "%"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (O == Op::REMU) {
+    uint32_t dividend = x[rs1];
+    uint32_t divisor = x[rs2];
+    uint32_t data = (divisor == 0) ? dividend : dividend % divisor;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":remu   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << x_label[rs2] << "       "
+                   << x_label[rd] << "=" << hex_format(x[rs1], 8) << "%"
+                   << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
+                   << '\n';
+    loadRd(data, rd, x);
+    return true;
+  } else if constexpr (isBranch(O)) {
+    const int32_t branchImm = inst.imm;
+    uint32_t nextPc = pc + 4;
+    bool taken = false;
+    std::string_view mnemonic = "geu";
+    std::string_view comparison = ">=";
+    if constexpr (O == Op::BEQ) {
+      taken = x[rs1] == x[rs2];
+      mnemonic = "eq";
+      comparison = "==";
+    } else if constexpr (O == Op::BNE) {
+      taken = x[rs1] != x[rs2];
+      mnemonic = "ne";
+      comparison = "!=";
+    } else if constexpr (O == Op::BLT) {
+      taken = static_cast<int32_t>(x[rs1]) < static_cast<int32_t>(x[rs2]);
+      mnemonic = "lt";
+      comparison = "<";
+    } else if constexpr (O == Op::BGE) {
+      taken = static_cast<int32_t>(x[rs1]) >= static_cast<int32_t>(x[rs2]);
+      mnemonic = "ge";
+    } else if constexpr (O == Op::BLTU) {
+      taken = x[rs1] < x[rs2];
+      mnemonic = "ltu";
+      comparison = "<";
+    } else if constexpr (O == Op::BGEU) {
+      taken = x[rs1] >= x[rs2];
+    }
+
+    if (taken)
+      nextPc = pc + branchImm;
+
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":b" << mnemonic << "    "
+                   << x_label[rs1] << "," << x_label[rs2] << ","
+                   << hex_format(branchImm, 3) << "        ("
+                   << hex_format(x[rs1], 8) << comparison
+                   << hex_format(x[rs2], 8) << ")=" << taken
+                   << "->pc=" << hex_format(nextPc, 8) << '\n';
+
+    if (taken)
+      pc = nextPc - 4;
+    return true;
+  } else if constexpr (O == Op::JAL) {
+    const int32_t jalOffset = inst.imm;
+    const uint32_t data = pc + 4;
+    const uint32_t address = pc + jalOffset;
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":jal    " << x_label[rd] << ","
+                   << hex_format((jalOffset / 2), 5)
+                   << "         pc=" << hex_format(address, 8) << ","
+                   << x_label[rd] << "=" << hex_format(data, 8) << '\n';
+    loadRd(data, rd, x);
+    pc = address - 4;
+    return true;
+  } else if constexpr (O == Op::JALR) {
+    const int32_t simm = inst.imm;
+    const uint32_t data = pc + 4;
+    uint32_t address = (x[rs1] + simm);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":jalr   " << x_label[rd] << ","
+                   << x_label[rs1] << "," << hex_format(simm & 0xFFF, 3)
+                   << "    pc=" << hex_format(x[rs1], 8) << "+"
+                   << hex_format(simm, 8) << "," << x_label[rd] << "="
+                   << hex_format(data, 8) << '\n';
+    loadRd(data, rd, x);
+    pc = (address & ~1) - 4;
+    return true;
+  } else if constexpr (O == Op::ECALL) {
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":ecall" << '\n';
+    triggerException(11, pc, pc, mepc, mcause, mtvec, mtval, mstatus);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << ">exception:environment_call        cause="
+                   << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
+                   << ",tval=" << hex_format(mtval, 8) << '\n';
+    return false;
+  } else if constexpr (O == Op::MRET) {
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":mret                         pc="
+                   << hex_format(mepc, 8) << '\n';
+    uint32_t mpie = (mstatus >> 7) & 1;
+    mstatus &= ~(0b11 << 11);
+    mstatus |= (0b11 << 11);
+    mstatus &= ~(1 << 3);
+    mstatus |= (mpie << 3);
+    mstatus |= (1 << 7);
+    pc = mepc;
+    return false;
+  } else if constexpr (O == Op::EBREAK) {
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << hex_format(pc, 8) << ":ebreak" << '\n';
+    files.flush();
+    run = false;
+    return true;
+  } else if constexpr (isCsr(O)) {
+    const uint16_t csrAddress = inst.imm;
+    const uint8_t uimm_csr = rs1;
+    updateMip();
+    uint32_t oldCsrValue =
+        readCsr(csrAddress, mepc, mcause, mtvec, mtval, mstatus, mie, mip);
+    uint32_t newCsrValue;
+
+    if constexpr (O == Op::CSRRW) {
+      newCsrValue = x[rs1];
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrw  " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << "," << x_label[rs1]
+                     << "       " << x_label[rd] << "="
+                     << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress) << "=" << x_label[rs1] << "="
+                     << hex_format(newCsrValue, 8) << '\n';
+      writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+               mie, mip);
+      loadRd(oldCsrValue, rd, x);
+    } else if constexpr (O == Op::CSRRS) {
+      newCsrValue = oldCsrValue | x[rs1];
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrs  " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << "," << x_label[rs1]
+                     << "       " << x_label[rd] << "="
+                     << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress) << "|=" << x_label[rs1] << "="
+                     << hex_format(oldCsrValue, 8) << "|"
+                     << hex_format(x[rs1], 8) << "="
+                     << hex_format(newCsrValue, 8) << '\n';
+      loadRd(oldCsrValue, rd, x);
+      if (rs1 != 0) {
+        writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+                 mie, mip);
+      }
+    } else if constexpr (O == Op::CSRRC) {
+      newCsrValue = oldCsrValue & ~x[rs1];
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrc  " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << "," << x_label[rs1]
+                     << "       " << x_label[rd] << "="
+                     << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress) << "&~=" << x_label[rs1] << "="
+                     << hex_format(oldCsrValue, 8) << "&~"
+                     << hex_format(x[rs1], 8) << "="
+                     << hex_format(newCsrValue, 8) << '\n';
+      loadRd(oldCsrValue, rd, x);
+      if (rs1 != 0) {
+        writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+                 mie, mip);
+      }
+    } else if constexpr (O == Op::CSRRWI) {
+      newCsrValue = uimm_csr;
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrwi " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << ","
+                     << static_cast<unsigned int>(uimm_csr) << "        "
+                     << x_label[rd] << "=" << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress)
+                     << "=u5=" << hex_format(newCsrValue, 8) << '\n';
+      writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+               mie, mip);
+      loadRd(oldCsrValue, rd, x);
+    } else if constexpr (O == Op::CSRRSI) {
+      newCsrValue = oldCsrValue | uimm_csr;
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrsi " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << ","
+                     << static_cast<unsigned int>(uimm_csr) << "        "
+                     << x_label[rd] << "=" << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress)
+                     << "|=u5=" << hex_format(oldCsrValue, 8) << "|"
+                     << hex_format(uimm_csr, 8) << "="
+                     << hex_format(newCsrValue, 8) << '\n';
+      loadRd(oldCsrValue, rd, x);
+      if (uimm_csr != 0) {
+        writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+                 mie, mip);
+      }
+    } else {
+      newCsrValue = oldCsrValue & ~uimm_csr;
+      if constexpr (Trace::INSTRUCTIONS)
+        files.output << hex_format(pc, 8) << ":csrrci " << x_label[rd] << ","
+                     << getCsrName(csrAddress) << ","
+                     << static_cast<unsigned int>(uimm_csr) << "        "
+                     << x_label[rd] << "=" << getCsrName(csrAddress) << "="
+                     << hex_format(oldCsrValue, 8) << ","
+                     << getCsrName(csrAddress)
+                     << "&~=u5=" << hex_format(oldCsrValue, 8) << "&~"
+                     << hex_format(uimm_csr, 8) << "="
+                     << hex_format(newCsrValue, 8) << '\n';
+      loadRd(oldCsrValue, rd, x);
+      if (uimm_csr != 0) {
+        writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
+                 mie, mip);
+      }
+    }
+    return true;
+  } else {
+    triggerException(2, inst.raw, pc, mepc, mcause, mtvec, mtval, mstatus);
+    if constexpr (Trace::INSTRUCTIONS)
+      files.output << ">exception:illegal_instruction   cause="
+                   << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
+                   << ",tval=" << hex_format(inst.raw, 8) << '\n';
+    return false;
+  }
+}
+
+// Returns false when the instruction trapped or redirected pc itself.
+template <class Trace> bool Hart::dispatch(const DecodedInstruction &inst) {
+  switch (inst.op) {
+#define OP_CASE(name)                                                          \
+  case Op::name:                                                               \
+    return execute<Trace, Op::name>(inst);
+    RV32_OPS(OP_CASE)
+#undef OP_CASE
+  }
+  return false;
+}
+
+template <class Trace> Hart::Step Hart::step() {
+  if (takeInterrupt<Trace>() || fetchFault<Trace>())
+    return Step::TRAP;
+
+  const DecodedInstruction &inst = fetch<Trace>();
+  const Op op = inst.op;
+  if (dispatch<Trace>(inst)) {
+    retire();
+    return Step::NEXT;
+  }
+  if (op == Op::MRET)
+    return Step::MRET;
+  return run ? Step::TRAP : Step::NEXT;
+}
+
+template <class Trace> void Hart::runSwitch() {
+  while (running())
+    step<Trace>();
+}
+
+// Threaded dispatch: every handler ends with its own indirect jump to the
+// next handler, so the host predictor sees one branch per guest opcode
+// instead of a single shared switch. mip is only refreshed when interrupts
+// can actually be taken; CSR handlers refresh it before reading it.
+template <class Trace> void Hart::runThreaded() {
+#define OP_LABEL(name) &&op_##name,
+  static const void *const handlers[] = {RV32_OPS(OP_LABEL) &&halt};
+#undef OP_LABEL
+  const DecodedInstruction *inst;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    while (running()) {                                                        \
+      if (interruptsEnabled() && takeInterrupt<Trace>())                       \
+        continue;                                                              \
+      if (fetchFault<Trace>())                                                 \
+        continue;                                                              \
+      inst = &fetch<Trace>();                                                  \
+      goto *handlers[static_cast<uint8_t>(inst->op)];                          \
+    }                                                                          \
+    goto halt;                                                                 \
+  } while (0)
+
+  DISPATCH();
+
+#define OP_HANDLER(name)                                                       \
+  op_##name:                                                                   \
+  if (execute<Trace, Op::name>(*inst))                                         \
+    retire();                                                                  \
+  DISPATCH();
+  RV32_OPS(OP_HANDLER)
+#undef OP_HANDLER
+#undef DISPATCH
+
+halt:
+  return;
+}
+
+// Executes `block` from its first instruction and returns the block to chain
+// into, or nullptr when control has to go back to the dispatcher. The block
+// is left early wherever the per-instruction loop could behave differently:
+// when the timer is about to fire, after a store to a device (which may raise
+// an interrupt), after a store that overwrote this block, on a trap, and when
+// the i-cache returns a word other than the one the block was built from.
+template <class Trace> Block *Hart::runBlock(Block &block) {
+  const uint64_t budget = timerBudget();
+  const size_t count = block.ops.size();
+  for (size_t i = 0; i < count; ++i) {
+    if (i >= budget)
+      return nullptr;
+
+    const DecodedInstruction &inst = block.ops[i];
+    const uint32_t instruction = iCache.read<Trace>(pc, mem);
+    if (instruction != inst.raw) {
+      if (dispatch<Trace>(decodeCache.lookup(pc, instruction)))
+        retire();
+      return nullptr;
+    }
+
+    const bool deviceStore =
+        isStore(inst.op) && !inRam(x[inst.rs1] + inst.imm);
+    if (!dispatch<Trace>(inst))
+      return nullptr;
+    retire();
+    if (deviceStore || !block.valid)
+      return nullptr;
+  }
+  return running() ? blockCache.successor(block, pc) : nullptr;
+}
+
+// One instruction of a block translated by --translate. The record is a
+// compile-time constant, so the checks runBlock makes per instruction are
+// the only thing left around the handler. The raw-word comparison also
+// covers code overwritten since translation: the interpreter runs whatever
+// the i-cache returns.
+template <class Trace, Op O>
+bool Hart::aotStep(const DecodedInstruction &inst, uint64_t index,
+                   uint64_t budget) {
+  if (index >= budget)
+    return false;
+
+  const uint32_t instruction = iCache.read<Trace>(pc, mem);
+  if (instruction != inst.raw) {
+    if (dispatch<Trace>(decodeCache.lookup(pc, instruction)))
+      retire();
+    return false;
+  }
+
+  const bool deviceStore = isStore(O) && !inRam(x[inst.rs1] + inst.imm);
+  if (!execute<Trace, O>(inst))
+    return false;
+  retire();
+  return !deviceStore;
+}
+
+int64_t jitLoad(Hart *hart, uint32_t address, uint32_t op, uint32_t pc) {
+  if (!hart->inRam(address))
+    return -1;
+  hart->fetchNative<NoTrace>(pc + 4);
+  const uint32_t wordData = hart->dCache.read<NoTrace>(address, hart->mem);
+  const uint32_t byteOffset = address & 0x3;
+  switch (static_cast<Op>(op)) {
+  case Op::LB:
+    return static_cast<uint32_t>(
+        static_cast<int8_t>(wordData >> (byteOffset * 8)));
+  case Op::LH:
+    return static_cast<uint32_t>(
+        static_cast<int16_t>(wordData >> (byteOffset * 8)));
+  case Op::LBU:
+    return (wordData >> (byteOffset * 8)) & 0xFF;
+  case Op::LHU:
+    return (wordData >> (byteOffset * 8)) & 0xFFFF;
   default:
-    return 0;
+    return wordData;
+  }
+}
+
+// Returns 0 to continue, 1 to leave before the store (not RAM) and 2 to leave
+// after it because it overwrote the running block.
+uint32_t jitStore(Hart *hart, uint32_t address, uint32_t data, uint32_t op,
+                  uint32_t pc) {
+  if (!hart->inRam(address))
+    return 1;
+  hart->fetchNative<NoTrace>(pc + 4);
+  const Op store = static_cast<Op>(op);
+  const uint8_t funct3 = (store == Op::SB)   ? 0b000
+                         : (store == Op::SH) ? 0b001
+                                             : 0b010;
+  hart->dCache.write<NoTrace>(address, data, funct3, hart->mem);
+  hart->invalidateCode(address, 1 << funct3);
+  return hart->jitBlock->valid ? 0 : 2;
+}
+
+// After a store has overwritten code the i-cache may still hold the old
+// words, which the interpreter would execute; native code must not run then.
+bool Hart::fetchMatches(const Block &block) const {
+  if (blockCache.invalidated == 0)
+    return true;
+  for (uint32_t i = 0; i < block.codeLength; ++i) {
+    const uint32_t *word = iCache.peek(block.startPc + 4 * i);
+    if (word && *word != block.ops[i].raw)
+      return false;
+  }
+  return true;
+}
+
+// Re-executes the instructions the native code just retired with the
+// interpreter, fetches included, starting from the state saved before the
+// call, and aborts on any difference in registers, pc, memory or the state
+// of any cache level.
+void Hart::checkLockstep(Block &block, uint32_t retired) {
+  const std::array<uint32_t, 32> jitX = x;
+  const std::vector<uint8_t> jitMem = mem;
+  const uint32_t jitPc = pc;
+  const Cache jitICache = iCache;
+  const Cache jitDCache = dCache;
+  std::vector<std::unique_ptr<CacheLevel>> jitLevels;
+  for (const auto &level : levels)
+    jitLevels.push_back(level->clone());
+
+  x = lockstepX;
+  mem = lockstepMem;
+  iCache = lockstepICache;
+  dCache = lockstepCache;
+  for (size_t i = 0; i < levels.size(); ++i)
+    levels[i]->restore(*lockstepLevels[i]);
+  pc = block.startPc;
+  for (uint32_t i = 0; i < retired; ++i) {
+    iCache.read<NoTrace>(pc, mem);
+    if (!dispatch<NoTrace>(block.ops[i])) {
+      std::cerr << "FATAL: lockstep: interpreter trapped at "
+                << hex_format(pc, 8) << std::endl;
+      files.flush();
+      exit(EXIT_FAILURE);
+    }
+    pc += 4;
+  }
+
+  bool cachesMatch =
+      iCache.matches(jitICache) && dCache.matches(jitDCache);
+  for (size_t i = 0; i < levels.size(); ++i)
+    cachesMatch = cachesMatch && levels[i]->matches(*jitLevels[i]);
+  if (x != jitX || mem != jitMem || pc != jitPc || !cachesMatch) {
+    std::cerr << "FATAL: lockstep mismatch in block "
+              << hex_format(block.startPc, 8) << " after " << retired
+              << " instructions" << std::endl;
+    for (int r = 0; r < 32; ++r) {
+      if (x[r] != jitX[r])
+        std::cerr << "  " << x_label[r]
+                  << ": interpreter=" << hex_format(x[r], 8)
+                  << " jit=" << hex_format(jitX[r], 8) << std::endl;
+    }
+    if (pc != jitPc)
+      std::cerr << "  pc: interpreter=" << hex_format(pc, 8)
+                << " jit=" << hex_format(jitPc, 8) << std::endl;
+    if (!cachesMatch)
+      std::cerr << "  cache state differs" << std::endl;
+    files.flush();
+    exit(EXIT_FAILURE);
+  }
+}
+
+template <class Trace> Block *Hart::runCompiled(Block &block) {
+  if (jitLockstep) {
+    lockstepX = x;
+    lockstepMem = mem;
+    lockstepICache = iCache;
+    lockstepCache = dCache;
+    lockstepLevels.clear();
+    for (const auto &level : levels)
+      lockstepLevels.push_back(level->clone());
+  }
+
+  jitBlock = &block;
+  jitFetched = block.startPc;
+  const uint64_t result = block.code(x.data(), this);
+  jitBlock = nullptr;
+  const uint32_t retired = static_cast<uint32_t>(result >> 32);
+  pc = static_cast<uint32_t>(result);
+  fetchNative<Trace>(block.startPc + 4 * retired);
+  if (jitLockstep)
+    checkLockstep(block, retired);
+
+  mtime += retired;
+  instret += retired;
+
+  if (!block.valid)
+    return nullptr;
+  if (retired < block.codeLength) {
+    // Side exit: a load or store left RAM. Budget and interrupt state are
+    // unchanged since block entry, so the interpreter can take it directly.
+    if (dispatch<Trace>(fetch<Trace>()))
+      retire();
+    return nullptr;
+  }
+  if (block.codeLength < block.ops.size() || !running())
+    return nullptr;
+  return blockCache.successor(block, pc);
+}
+
+template <class Trace> Block *Hart::enterBlock(Block &block) {
+  if (jitEnabled) {
+    if (block.code) {
+      if (block.codeLength <= timerBudget() && fetchMatches(block))
+        return runCompiled<Trace>(block);
+    } else if (++block.executions == jitThreshold) {
+      block.code = jit.compile(block, block.codeLength);
+    }
+  }
+  return runBlock<Trace>(block);
+}
+
+// Block engine: interrupts, the timer and the fetch bounds are only checked
+// when control moves from one block to the next.
+template <class Trace> void Hart::runBlocks() {
+  while (running()) {
+    if (interruptsEnabled() && takeInterrupt<Trace>())
+      continue;
+    if (fetchFault<Trace>())
+      continue;
+
+    if (jit.full()) {
+      jit.reset();
+      blockCache.dropCode();
+    }
+    blockCache.flushRetired();
+    Block *block = blockCache.lookup(pc);
+    if (!block) {
+      if (dispatch<Trace>(fetch<Trace>()))
+        retire();
+      continue;
+    }
+    while (block) {
+      block = enterBlock<Trace>(*block);
+      if (block && interruptsEnabled() && takeInterrupt<Trace>())
+        break;
+    }
+  }
+}
+
+// Tier 0 of the tiered engine: interprets up to the end of what would be the
+// block at pc, checking interrupts between instructions like runThreaded.
+template <class Trace> void Hart::runCold() {
+  for (size_t i = 1;; ++i) {
+    const DecodedInstruction &inst = fetch<Trace>();
+    const bool last = endsBlock(inst.op);
+    if (!dispatch<Trace>(inst))
+      return;
+    retire();
+    if (last || !running() || i == Block::MAX_LENGTH)
+      return;
+    if (interruptsEnabled() && takeInterrupt<Trace>())
+      return;
+    if (fetchFault<Trace>())
+      return;
+  }
+}
+
+// Tiered engine: code starts in the interpreter and a block is translated
+// only after --tier-threshold entries, then compiled after --jit-threshold
+// block executions when --jit is on. Overwriting code drops its block (and
+// native code), which sends it back to tier 0.
+template <class Trace> void Hart::runTiered() {
+  while (running()) {
+    if (interruptsEnabled() && takeInterrupt<Trace>())
+      continue;
+    if (fetchFault<Trace>())
+      continue;
+
+    if (jit.full()) {
+      jit.reset();
+      blockCache.dropCode();
+    }
+    blockCache.flushRetired();
+    Block *block = blockCache.lookup(pc);
+    if (!block) {
+      runCold<Trace>();
+      continue;
+    }
+    while (block) {
+      block = enterBlock<Trace>(*block);
+      if (block && interruptsEnabled() && takeInterrupt<Trace>())
+        break;
+    }
   }
 }
 
-void writeCsr(uint16_t address, uint32_t data, uint32_t &mepc, uint32_t &mcause,
-              uint32_t &mtvec, uint32_t &mtval, uint32_t &mstatus,
-              uint32_t &mie, uint32_t &mip) {
-  switch (address) {
-  case 0x300:
-    mstatus = data;
-    break;
-  case 0x304:
-    mie = data;
+// Translated engine: blocks found by --translate run as native functions and
+// chain into their static successors; anything else (code reached only
+// through a register the translator could not follow, or a pc in the middle
+// of a translated block) goes through the block interpreter.
+template <class Trace> void Hart::runAot() {
+  aotAt.assign(mem.size() / 4, nullptr);
+  for (size_t i = 0; i < aotBlockCount; ++i) {
+    if (inRam(aotBlocks[i].pc))
+      aotAt[(aotBlocks[i].pc - MemoryMap::OFFSET) >> 2] = &aotBlocks[i];
+  }
+
+  while (running()) {
+    if (interruptsEnabled() && takeInterrupt<Trace>())
+      continue;
+    if (fetchFault<Trace>())
+      continue;
+
+    const AotBlock *native =
+        (pc & 0x3) ? nullptr : aotAt[(pc - MemoryMap::OFFSET) >> 2];
+    if (!native) {
+      blockCache.flushRetired();
+      Block *block = blockCache.lookup(pc);
+      if (!block) {
+        if (dispatch<Trace>(fetch<Trace>()))
+          retire();
+      } else {
+        runBlock<Trace>(*block);
+      }
+      continue;
+    }
+    while (native) {
+      native = native->run[static_cast<size_t>(Trace::MODE)](*this);
+      if (native && interruptsEnabled() && takeInterrupt<Trace>())
+        break;
+    }
+  }
+}
+
+template <class Trace> void Hart::simulate(Engine engine) {
+  switch (engine) {
+  case Engine::SWITCH:
+    runSwitch<Trace>();
     break;
-  case 0x305:
-    mtvec = data;
+  case Engine::THREADED:
+    runThreaded<Trace>();
     break;
-  case 0x341:
-    mepc = data;
+  case Engine::BLOCK:
+    runBlocks<Trace>();
     break;
-  case 0x342:
-    mcause = data;
+  case Engine::TIERED:
+    runTiered<Trace>();
     break;
-  case 0x343:
-    mtval = data;
+  case Engine::AOT:
+    runAot<Trace>();
     break;
-  case 0x344:
-    mip = data;
+  }
+}
+
+// Per-instruction part of a filtered run, up to stopAt. With the trap window
+// tracing starts at the first trap, counting nested ones, and ends with the
+// mret that returns from it. When the trap is an instruction's own exception
+// the window opens at the handler, as the step that raised it already ran
+// untraced.
+template <class Trace> void Hart::runWindow(const TraceFilter &filter) {
+  bool open = !filter.trapWindow;
+  uint32_t depth = 0;
+  while (running()) {
+    const bool covered = filter.covers(pc);
+    if (!open && covered && (takeInterrupt<Trace>() || fetchFault<Trace>())) {
+      open = true;
+      depth = 1;
+      continue;
+    }
+    const Step result = open && covered ? step<Trace>() : step<StatsTrace>();
+    if (!filter.trapWindow)
+      continue;
+    if (result == Step::TRAP) {
+      open = true;
+      depth++;
+    } else if (result == Step::MRET && open && --depth == 0) {
+      return;
+    }
+  }
+}
+
+// Filtered run: the engine runs untraced up to the window and after it, and
+// traced inside it unless the filter has to be checked per instruction.
+template <class Trace>
+void Hart::simulate(Engine engine, const TraceFilter &filter) {
+  stopAt = filter.from;
+  simulate<StatsTrace>(engine);
+  stopAt = filter.to;
+  if (filter.perInstruction())
+    runWindow<Trace>(filter);
+  else
+    simulate<Trace>(engine);
+  stopAt = UINT64_MAX;
+  simulate<StatsTrace>(engine);
+}
+
+// Re-executes the event `record` describes, so that the lines the Trace policy
+// writes for it come from the same handlers as in a live run. Returns what did
+// not match the record, or nullptr.
+template <class Trace> const char *Hart::replay(const TraceRecord &record) {
+  switch (record.kind) {
+  case RecordKind::INTERRUPT:
+    return takeInterrupt<Trace>() ? nullptr : "no interrupt pending";
+  case RecordKind::FETCH_FAULT:
+    return fetchFault<Trace>() ? nullptr : "no instruction fault";
+  case RecordKind::INSTRUCTION:
+  case RecordKind::EXCEPTION:
     break;
   }
+  if (pc != record.pc)
+    return "pc";
+  const uint32_t word = iCache.read<Trace>(pc, mem);
+  if (word != record.raw || iCache.lastAccess != record.iCache)
+    return "instruction fetch";
+  const DecodedInstruction inst = decode(word);
+  dCache.lastAccess = 0;
+  const bool retired = dispatch<Trace>(inst);
+  if (dCache.lastAccess != record.dCache)
+    return "data cache access";
+  if (retired) {
+    if (x[inst.rd] != record.value)
+      return "rd value";
+    retire();
+  }
+  return pc == record.nextPc ? nullptr : "next pc";
 }
 
-int main(int argc, char *argv[]) {
-  std::cout << "Code being executed..." << std::endl;
+// Formats a full or cache trace on worker threads (--format-threads=N). The
+// hart runs under BinaryTrace and hands its records over in chunks, each with
+// the HartState it starts from. A worker replays a chunk on its own Hart into
+// text, and the emulator thread, as sequencer, writes finished chunks to the
+// trace in their original order.
+class FormatPool {
+public:
+  FormatPool(Files &files, const Hart &hart, unsigned threads,
+             size_t chunkRecords, TraceMode mode)
+      : files(files), chunkRecords(chunkRecords), maxInFlight(4 * threads) {
+    filling.reset(new Chunk{hart.saveState(), false, {}, {}, 0, false, {}});
+    filling->records.reserve(chunkRecords);
+    for (unsigned i = 0; i < threads; ++i) {
+      workers.emplace_back(mode == TraceMode::CACHE
+                               ? &FormatPool::work<CacheTrace>
+                               : &FormatPool::work<FullTrace>,
+                           this);
+    }
+  }
 
-  Files files(argc, argv);
+  ~FormatPool() { finish(); }
 
-  uint32_t pc = MemoryMap::OFFSET;
-  std::array<uint32_t, 32> x = {0};
+  void add(const Hart &hart, const TraceRecord &record, bool retiring) {
+    filling->records.push_back(record);
+    if (filling->records.size() < chunkRecords)
+      return;
+    std::unique_ptr<Chunk> next(
+        new Chunk{hart.saveState(), retiring, {}, {}, 0, false, {}});
+    next->records.reserve(chunkRecords);
+    submit(std::move(filling));
+    filling = std::move(next);
+    writeReady();
+  }
 
-  const std::array<const char *, 32> x_label = {
-      "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "s0", "s1", "a0",
-      "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
-      "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+  // Formats and writes what is left, then stops the workers.
+  void finish() {
+    if (workers.empty())
+      return;
+    if (!filling->records.empty())
+      submit(std::move(filling));
+    while (!inFlight.empty())
+      writeOldest();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    workReady.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+    workers.clear();
+  }
 
-  std::vector<uint8_t> mem(32 * 1024);
-  loadMemory(files.input, MemoryMap::OFFSET, mem);
+private:
+  // `retirePending`: the state was saved between an instruction's record
+  // and its retire(). `error` is set when the replay diverged; `text` then
+  // holds the lines up to that point.
+  class Chunk {
+  public:
+    HartState state;
+    bool retirePending;
+    std::vector<TraceRecord> records;
+    std::string text;
+    uint64_t lines;
+    bool done;
+    std::string error;
+  };
 
-  Cache iCache("i", files.output);
-  Cache dCache("d", files.output);
+  Files &files;
+  const size_t chunkRecords;
+  const size_t maxInFlight;
+  std::unique_ptr<Chunk> filling;
+  // Submitted chunks in trace order; only the emulator thread touches it.
+  std::deque<std::unique_ptr<Chunk>> inFlight;
+  // Chunks no worker has taken yet, guarded by `mutex` like Chunk::done.
+  std::deque<Chunk *> queue;
+  std::mutex mutex;
+  std::condition_variable workReady;
+  std::condition_variable chunkDone;
+  bool stopping = false;
+  std::vector<std::thread> workers;
 
-  bool run = true;
-  uint32_t mepc = 0, mcause = 0, mtvec = 0, mtval = 0, mstatus = 0, mie = 0,
-           mip = 0;
-  uint64_t mtime = 0, mtimecmp = 0;
-  uint32_t clintMsip = 0;
-  uint32_t plicPendingReg = 0, plicEnableReg = 0, plicThresholdReg = 0;
+  void submit(std::unique_ptr<Chunk> chunk) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(chunk.get());
+    }
+    workReady.notify_one();
+    inFlight.push_back(std::move(chunk));
+    while (inFlight.size() > maxInFlight)
+      writeOldest();
+  }
 
-  while (run) {
-    if (clintMsip > 0) {
-      mip |= (1 << 3);
-    } else {
-      mip &= ~(1 << 3);
+  void writeOldest() {
+    Chunk &chunk = *inFlight.front();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      chunkDone.wait(lock, [&] { return chunk.done; });
     }
+    files.output.writeFormatted(chunk.text, chunk.lines);
+    if (!chunk.error.empty())
+      fail(chunk.error);
+    inFlight.pop_front();
+  }
 
-    if (mtime >= mtimecmp) {
-      mip |= (1 << 7);
-    } else {
-      mip &= ~(1 << 7);
+  // Runs on the emulator thread: stops the workers, keeping the trace
+  // written so far, then exits.
+  [[noreturn]] void fail(const std::string &error) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.clear();
+      stopping = true;
     }
+    workReady.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+    workers.clear();
+    std::cerr << error << std::endl;
+    files.flush();
+    exit(EXIT_FAILURE);
+  }
 
-    uint32_t plicPendingAndEnabled = plicPendingReg & plicEnableReg;
-    if (plicPendingAndEnabled) {
-      mip |= (1 << 11);
-    } else {
-      mip &= ~(1 << 11);
+  void writeReady() {
+    while (!inFlight.empty()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!inFlight.front()->done)
+          return;
+      }
+      writeOldest();
     }
+  }
 
-    uint32_t pendingAndEnabled = mip & mie;
-    uint32_t globalInterruptEnable = (mstatus >> 3) & 1;
+  template <class Trace> void work() {
+    std::string text, terminal;
+    Files output(text, terminal);
+    Hart hart(output, MemoryMap::RAM_SIZE);
+    for (;;) {
+      Chunk *chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        workReady.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (queue.empty())
+          return;
+        chunk = queue.front();
+        queue.pop_front();
+      }
 
-    if (globalInterruptEnable && pendingAndEnabled != 0) {
-      if (pendingAndEnabled & (1 << 11)) { // External Interrupt
-        triggerException(0x8000000b, 0, pc, mepc, mcause, mtvec, mtval,
-                         mstatus);
-        files.output << ">interrupt:external              cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
+      hart.loadState(chunk->state);
+      if (chunk->retirePending)
+        hart.retire();
+      const uint64_t lines = output.output.lines;
+      std::string error;
+      for (const TraceRecord &record : chunk->records) {
+        if (const char *what = hart.replay<Trace>(record)) {
+          std::ostringstream message;
+          message << "FATAL: trace replay diverged at pc="
+                  << hex_format(record.pc, 8) << ": " << what;
+          error = message.str();
+          break;
+        }
       }
-      if (pendingAndEnabled & (1 << 7)) { // Timer Interrupt
-        triggerException(0x80000007, 0, pc, mepc, mcause, mtvec, mtval,
-                         mstatus);
-        files.output << ">interrupt:timer                 cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
+      output.output.flush();
+      terminal.clear();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      chunk->error.swap(error);
+      chunk->text.swap(text);
+      text.clear();
+      chunk->lines = output.output.lines - lines;
+      chunk->done = true;
+      chunkDone.notify_all();
+    }
+  }
+};
+
+void Hart::writeRecord(const TraceRecord &record, bool retiring) {
+  if (formatPool)
+    formatPool->add(*this, record, retiring);
+  else if (packedTrace)
+    packedTrace->add(record);
+  else
+    files.output.write(reinterpret_cast<const char *>(&record),
+                       sizeof(record));
+}
+
+// Static translator behind --translate. Starting at the reset vector it
+// follows fall-through, branch and jal edges, plus the jalr targets and
+// mtvec/mepc values that a block builds with lui/auipc/addi, and emits one
+// C++ function per block. The output includes this file, so it links
+// against the same execute<Op> handlers, devices and trap code.
+class Translator {
+private:
+  class Source {
+  public:
+    std::vector<DecodedInstruction> ops;
+    std::vector<uint32_t> successors;
+  };
+
+  std::vector<uint8_t> mem;
+  std::map<uint32_t, Source> blocks;
+  std::vector<uint32_t> pending;
+
+  bool inImage(uint32_t pc) const {
+    return !(pc & 0x3) && pc >= MemoryMap::OFFSET &&
+           pc < MemoryMap::OFFSET + mem.size();
+  }
+
+  uint32_t word(uint32_t pc) const {
+    const uint32_t at = pc - MemoryMap::OFFSET;
+    return mem[at] | (mem[at + 1] << 8) | (mem[at + 2] << 16) |
+           (mem[at + 3] << 24);
+  }
+
+  void follow(Source &source, uint32_t target) {
+    source.successors.push_back(target);
+    pending.push_back(target);
+  }
+
+  void build(uint32_t start) {
+    Source &source = blocks[start];
+    std::array<bool, 32> known = {true};
+    std::array<uint32_t, 32> value = {0};
+    uint32_t pc = start;
+    for (; inImage(pc) && source.ops.size() < Block::MAX_LENGTH; pc += 4) {
+      const DecodedInstruction inst = decode(word(pc));
+      source.ops.push_back(inst);
+      const Op op = inst.op;
+      const bool writesCsr = op == Op::CSRRW || op == Op::CSRRS;
+      if (writesCsr && known[inst.rs1] &&
+          (inst.imm == 0x305 || inst.imm == 0x341))
+        pending.push_back(value[inst.rs1] & ~0x3);
+
+      if (isBranch(op)) {
+        follow(source, pc + inst.imm);
+        follow(source, pc + 4);
+      } else if (op == Op::JAL) {
+        follow(source, pc + inst.imm);
+        pending.push_back(pc + 4);
+      } else if (op == Op::JALR) {
+        if (known[inst.rs1])
+          follow(source, (value[inst.rs1] + inst.imm) & ~1);
+        pending.push_back(pc + 4);
+      } else if (isCsr(op)) {
+        follow(source, pc + 4);
+      } else if (op == Op::ECALL) {
+        pending.push_back(pc + 4);
       }
-      if (pendingAndEnabled & (1 << 3)) { // Software Interrupt
-        triggerException(0x80000003, 0, pc, mepc, mcause, mtvec, mtval,
-                         mstatus);
-        files.output << ">interrupt:software              cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
+      if (endsBlock(op))
+        return;
+
+      if (op == Op::LUI || op == Op::AUIPC) {
+        known[inst.rd] = true;
+        value[inst.rd] = inst.imm + (op == Op::AUIPC ? pc : 0);
+      } else if (op == Op::ADDI && known[inst.rs1]) {
+        known[inst.rd] = true;
+        value[inst.rd] = value[inst.rs1] + inst.imm;
+      } else if (!isStore(op)) {
+        known[inst.rd] = false;
       }
+      known[0] = true;
+      value[0] = 0;
     }
+    if (inImage(pc))
+      follow(source, pc);
+  }
 
-    if ((pc < MemoryMap::OFFSET) ||
-        (pc >= (MemoryMap::OFFSET + mem.size() - 3))) {
-      triggerException(1, pc, pc, mepc, mcause, mtvec, mtval, mstatus);
-      files.output << ">exception:instruction_fault     cause="
-                   << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                   << ",tval=" << hex_format(pc, 8) << std::endl;
-      continue;
+public:
+  explicit Translator(std::ifstream &input) : mem(MemoryMap::RAM_SIZE) {
+    loadMemory(input, MemoryMap::OFFSET, mem);
+    pending.push_back(MemoryMap::OFFSET);
+    while (!pending.empty()) {
+      const uint32_t pc = pending.back();
+      pending.pop_back();
+      if (inImage(pc) && !blocks.count(pc))
+        build(pc);
     }
+  }
 
-    uint32_t instruction = iCache.read(pc, mem);
-    const uint8_t opcode = instruction & 0x7F;
-    const uint8_t funct7 = (instruction >> 25) & 0x7F;
-    const uint16_t imm = instruction >> 20;
-    const uint8_t uimm = (instruction >> 20) & 0x1F;
-    const uint8_t rs1 = (instruction >> 15) & 0x1F;
-    const uint8_t rs2 = (instruction >> 20) & 0x1F;
-    const uint8_t funct3 = (instruction >> 12) & 0x07;
-    const uint8_t rd = (instruction >> 7) & 0x1F;
-    const uint16_t immS =
-        ((instruction >> 25) & 0x7F) << 5 | ((instruction >> 7) & 0x1F);
+  void emit(std::ostream &out, const std::string &inputName) const {
+    std::map<uint32_t, size_t> index;
+    for (const auto &entry : blocks)
+      index.emplace(entry.first, index.size());
 
-    const uint32_t imm12 = (instruction >> 19) & 0x1000;
-    const uint32_t imm11 = (instruction & 0x80) << 4;
-    const uint32_t imm10_5 = (instruction >> 20) & 0x7E0;
-    const uint32_t imm4_1 = (instruction >> 7) & 0x1E;
-    const uint32_t imm_b_unsigned = imm12 | imm11 | imm10_5 | imm4_1;
-    const int32_t branchImm = (imm_b_unsigned & 0x1000)
-                                  ? (0xFFFFE000 | imm_b_unsigned)
-                                  : imm_b_unsigned;
+    out << "// Generated by poximv3 --translate " << inputName << "\n"
+        << "// Build next to poximv3.cpp: g++ -O2 -o <binary> <this file>\n"
+        << "#define POXIM_AOT\n"
+        << "#include \"poximv3.cpp\"\n";
 
-    const uint32_t imm_j_unsigned = (((instruction >> 31) & 0x1) << 20) |
-                                    (((instruction >> 12) & 0xFF) << 12) |
-                                    (((instruction >> 20) & 0x1) << 11) |
-                                    (((instruction >> 21) & 0x3FF) << 1);
-    const int32_t jalOffset = (imm_j_unsigned & 0x100000)
-                                  ? (0xFFE00000 | imm_j_unsigned)
-                                  : imm_j_unsigned;
-
-    switch (opcode) {
-    case 0b0010011:                                 // I-Type
-      if (funct3 == 0b001 && funct7 == 0b0000000) { // slli
-        const uint32_t data = x[rs1] << uimm;
-        files.output << hex_format(pc, 8) << ":slli   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << std::dec
-                     << static_cast<unsigned int>(uimm) << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "<<"
-                     << std::dec << static_cast<unsigned int>(uimm) << "="
-                     << hex_format(data, 8) << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b000) { // addi
-        const int32_t simm = signedImmediate(imm);
-        const int32_t data = simm + static_cast<int32_t>(x[rs1]);
-        files.output << hex_format(pc, 8) << ":addi   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
-                     << "+" << hex_format(simm, 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b111) { // andi
-        const uint32_t simm = signedImmediate(imm);
-        const uint32_t data = x[rs1] & simm;
-        files.output << hex_format(pc, 8) << ":andi   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
-                     << "&" << hex_format(simm, 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b110) { // ori
-        const uint32_t simm = signedImmediate(imm);
-        const uint32_t data = x[rs1] | simm;
-        files.output << hex_format(pc, 8) << ":ori    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
-                     << "|" << hex_format(simm, 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b100) { // xori
-        const uint32_t simm = signedImmediate(imm);
-        const uint32_t data = x[rs1] ^ simm;
-        files.output << hex_format(pc, 8) << ":xori   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "       " << x_label[rd] << "=" << hex_format(x[rs1], 8)
-                     << "^" << hex_format(simm, 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b010) { // slti
-        int32_t simm = signedImmediate(imm);
-        uint32_t data = (static_cast<int32_t>(x[rs1]) < simm) ? 1 : 0;
-        files.output << hex_format(pc, 8) << ":slti   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "     " << x_label[rd] << "=(" << hex_format(x[rs1], 8)
-                     << "<" << hex_format(simm, 8) << ")=" << std::dec << data
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b011) { // sltiu
-        uint32_t simm = signedImmediate(imm);
-        uint32_t data = (x[rs1] < simm) ? 1 : 0;
-        files.output << hex_format(pc, 8) << ":sltiu  " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "     " << x_label[rd] << "=(" << hex_format(x[rs1], 8)
-                     << "<" << hex_format(simm, 8) << ")=" << std::dec << data
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b101 && funct7 == 0b0000000) { // srli
-        const uint32_t data = x[rs1] >> uimm;
-        files.output << hex_format(pc, 8) << ":srli   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << std::dec
-                     << static_cast<unsigned int>(uimm) << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>"
-                     << std::dec << static_cast<unsigned int>(uimm) << "="
-                     << hex_format(data, 8) << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b101 && funct7 == 0b0100000) { // srai
-        const uint32_t data = static_cast<int32_t>(x[rs1]) >> uimm;
-        files.output << hex_format(pc, 8) << ":srai   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << std::dec
-                     << static_cast<unsigned int>(uimm) << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>>"
-                     << std::dec << static_cast<unsigned int>(uimm) << "="
-                     << hex_format(data, 8) << std::endl;
-        loadRd(data, rd, x);
+    for (const auto &entry : blocks) {
+      const Source &source = entry.second;
+      out << "\ntemplate <class Trace>\n"
+          << "static const AotBlock *block_" << std::hex << entry.first
+          << std::dec << "(Hart &hart) {\n"
+          << "  static constexpr DecodedInstruction ops[] = {\n";
+      for (const auto &inst : source.ops) {
+        out << "      {Op::" << opNames[static_cast<uint8_t>(inst.op)] << ", "
+            << +inst.rd << ", " << +inst.rs1 << ", " << +inst.rs2 << ", "
+            << inst.imm << ", " << hex_format(inst.raw, 8) << "u},\n";
       }
-      break;
-    case 0b0110111: { // lui
-      uint32_t immU = instruction & 0xFFFFF000;
-      uint32_t data = immU;
-      files.output << hex_format(pc, 8) << ":lui    " << x_label[rd] << ","
-                   << hex_format(immU >> 12, 5) << "         " << x_label[rd]
-                   << "=" << hex_format(data, 8) << std::endl;
-      loadRd(data, rd, x);
-      break;
-    }
-    case 0b0010111: { // auipc
-      uint32_t immU = instruction & 0xFFFFF000;
-      uint32_t data = immU + pc;
-      files.output << hex_format(pc, 8) << ":auipc  " << x_label[rd] << ","
-                   << hex_format(immU >> 12, 5) << "       " << x_label[rd]
-                   << "=" << hex_format(pc, 8) << "+" << hex_format(immU, 8)
-                   << "=" << hex_format(data, 8) << std::endl;
-      loadRd(data, rd, x);
-      break;
-    }
-    case 0b0000011: { // L-Type
-      const int32_t simm = signedImmediate(imm);
-      const uint32_t address = x[rs1] + simm;
-      uint32_t data = 0;
-      bool handled = true;
-
-      if (address >= MemoryMap::OFFSET &&
-          address < (MemoryMap::OFFSET + mem.size())) {
-        uint32_t wordData = dCache.read(address, mem);
-        uint32_t byteOffset = address & 0x3;
-
-        if (funct3 == 0b000) { // lb
-          data = static_cast<int8_t>(wordData >> (byteOffset * 8));
-          files.output << hex_format(pc, 8) << ":lb     " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        } else if (funct3 == 0b001) { // lh
-          data = static_cast<int16_t>(wordData >> (byteOffset * 8));
-          files.output << hex_format(pc, 8) << ":lh     " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        } else if (funct3 == 0b010) { // lw
-          data = wordData;
-          files.output << hex_format(pc, 8) << ":lw     " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        } else if (funct3 == 0b100) { // lbu
-          data = (wordData >> (byteOffset * 8)) & 0xFF;
-          files.output << hex_format(pc, 8) << ":lbu    " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        } else if (funct3 == 0b101) { // lhu
-          data = (wordData >> (byteOffset * 8)) & 0xFFFF;
-          files.output << hex_format(pc, 8) << ":lhu    " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        } else {
-          handled = false;
-        }
-      } else {
-        if (address == MemoryMap::CLINT_MSIP) {
-          data = clintMsip;
-        } else if (address == MemoryMap::CLINT_MTIMECMP) {
-          data = static_cast<uint32_t>(mtimecmp);
-        } else if (address == MemoryMap::CLINT_MTIMECMP + 4) {
-          data = static_cast<uint32_t>(mtimecmp >> 32);
-        } else if (address == MemoryMap::CLINT_MTIME) {
-          data = static_cast<uint32_t>(mtime);
-        } else if (address == MemoryMap::CLINT_MTIME + 4) {
-          data = static_cast<uint32_t>(mtime >> 32);
-        } else if (address ==
-                   MemoryMap::PLIC_ENABLE + (MemoryMap::UART_IRQ / 32) * 4) {
-          data = plicEnableReg;
-        } else if (address ==
-                   MemoryMap::PLIC_PENDING + (MemoryMap::UART_IRQ / 32) * 4) {
-          data = plicPendingReg;
-        } else if (address == MemoryMap::PLIC_THRESHOLD) {
-          data = plicThresholdReg;
-        } else if (address == MemoryMap::PLIC_CLAIM) {
-          data = ((plicPendingReg & plicEnableReg) & (1 << MemoryMap::UART_IRQ))
-                     ? MemoryMap::UART_IRQ
-                     : 0;
-        } else if (address == MemoryMap::UART_BASE + 2) {
-          data = 1;
-        } else {
-          handled = false;
-        }
-        if (handled) {
-          files.output << hex_format(pc, 8) << ":lw     " << x_label[rd] << ","
-                       << hex_format(imm & 0xFFF, 3) << "(" << x_label[rs1]
-                       << ")      " << x_label[rd] << "=mem["
-                       << hex_format(address, 8) << "]=" << hex_format(data, 8)
-                       << std::endl;
-        }
+      out << "  };\n"
+          << "  const uint64_t budget = hart.timerBudget();\n"
+          << "  if (!(";
+      for (size_t i = 0; i < source.ops.size(); ++i) {
+        out << (i ? " &&\n        " : "") << "hart.aotStep<Trace, Op::"
+            << opNames[static_cast<uint8_t>(source.ops[i].op)] << ">(ops["
+            << i << "], " << i << ", budget)";
       }
-
-      if (handled) {
-        loadRd(data, rd, x);
-      } else {
-        triggerException(5, address, pc, mepc, mcause, mtvec, mtval, mstatus);
-        files.output << ">exception:load_fault               cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
+      out << ") || !hart.run)\n"
+          << "    return nullptr;\n";
+      for (uint32_t successor : source.successors) {
+        const auto next = index.find(successor);
+        if (next == index.end())
+          continue;
+        out << "  if (hart.pc == " << hex_format(successor, 8) << "u)\n"
+            << "    return &aotBlocks[" << next->second << "];\n";
       }
-      break;
+      out << "  return nullptr;\n"
+          << "}\n";
     }
-    case 0b0100011: { // S-Type
-      const int32_t simm = signedImmediate(immS);
-      const uint32_t address = x[rs1] + simm;
-      const uint32_t data = x[rs2];
-      bool handled = true;
 
-      if (address >= MemoryMap::OFFSET &&
-          address < (MemoryMap::OFFSET + mem.size())) {
-        dCache.write(address, data, funct3, mem);
-        if (funct3 == 0b000) { // sb
-          files.output << hex_format(pc, 8) << ":sb     " << x_label[rs2] << ","
-                       << hex_format(immS, 3) << "(" << x_label[rs1]
-                       << ")      mem[" << hex_format(address, 8)
-                       << "]=" << hex_format(data & 0xFF, 2) << std::endl;
-        } else if (funct3 == 0b001) { // sh
-          files.output << hex_format(pc, 8) << ":sh     " << x_label[rs2] << ","
-                       << hex_format(immS, 3) << "(" << x_label[rs1]
-                       << ")      mem[" << hex_format(address, 8)
-                       << "]=" << hex_format(data & 0xFFFF, 4) << std::endl;
-        } else if (funct3 == 0b010) { // sw
-          files.output << hex_format(pc, 8) << ":sw     " << x_label[rs2] << ","
-                       << hex_format(immS, 3) << "(" << x_label[rs1]
-                       << ")      mem[" << hex_format(address, 8)
-                       << "]=" << hex_format(data, 8) << std::endl;
-        } else {
-          handled = false;
-        }
-      } else {
-        if (address == MemoryMap::CLINT_MSIP) {
-          clintMsip = data & 0x1;
-        } else if (address == MemoryMap::CLINT_MTIMECMP) {
-          mtimecmp = (mtimecmp & 0xFFFFFFFF00000000) | data;
-        } else if (address == MemoryMap::CLINT_MTIMECMP + 4) {
-          mtimecmp = (mtimecmp & 0x00000000FFFFFFFF) |
-                     (static_cast<uint64_t>(data) << 32);
-        } else if (address == MemoryMap::CLINT_MTIME) {
-          mtime = (mtime & 0xFFFFFFFF00000000) | data;
-        } else if (address == MemoryMap::CLINT_MTIME + 4) {
-          mtime = (mtime & 0x00000000FFFFFFFF) |
-                  (static_cast<uint64_t>(data) << 32);
-        } else if (address == MemoryMap::UART_TX_REG) {
-          files.terminalOutput.put(static_cast<char>(data));
-          files.terminalOutput.flush();
-          plicPendingReg |= (1 << MemoryMap::UART_IRQ);
-        } else if (address ==
-                   MemoryMap::PLIC_ENABLE + (MemoryMap::UART_IRQ / 32) * 4) {
-          plicEnableReg = data;
-        } else if (address == MemoryMap::PLIC_THRESHOLD) {
-          plicThresholdReg = data;
-        } else if (address == MemoryMap::PLIC_CLAIM) {
-          if (data == MemoryMap::UART_IRQ)
-            plicPendingReg &= ~(1 << MemoryMap::UART_IRQ);
-        } else {
-          handled = false;
-        }
-        if (handled)
-          files.output << hex_format(pc, 8) << ":sw     " << x_label[rs2] << ","
-                       << hex_format(immS, 3) << "(" << x_label[rs1]
-                       << ")      mem[" << hex_format(address, 8)
-                       << "]=" << hex_format(data, 8) << std::endl;
-      }
+    out << "\nconst AotBlock aotBlocks[] = {\n";
+    for (const auto &entry : blocks) {
+      out << "    {" << hex_format(entry.first, 8) << "u, AOT_BLOCK(block_"
+          << std::hex << entry.first << std::dec << ")},\n";
+    }
+    out << "};\n"
+        << "const size_t aotBlockCount = " << blocks.size() << ";\n";
+  }
 
-      if (!handled) {
-        triggerException(7, address, pc, mepc, mcause, mtvec, mtval, mstatus);
-        files.output << ">exception:store_fault              cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
-      }
-      break;
+  size_t size() const { return blocks.size(); }
+};
+
+int translate(const char *inputName, const char *outputName) {
+  std::ifstream input(inputName);
+  std::ofstream output(outputName);
+  if (!input.is_open() || !output.is_open()) {
+    std::cerr << "FATAL: Failed to open one or more files." << std::endl;
+    return EXIT_FAILURE;
+  }
+  const Translator translator(input);
+  translator.emit(output, inputName);
+  std::cout << "Translated " << translator.size() << " blocks." << std::endl;
+  return 0;
+}
+
+#ifndef POXIM_NO_MAIN
+int main(int argc, char *argv[]) {
+  if (argc == 4 && std::string(argv[1]) == "--translate")
+    return translate(argv[2], argv[3]);
+
+  std::cout << "Code being executed..." << std::endl;
+
+  Files files(argc, argv);
+  Options options(argc, argv);
+  Hart hart(files, MemoryMap::RAM_SIZE, options.iCache, options.dCache);
+  hart.dCache.setWritePolicy(options.dWrite);
+  for (size_t i = 0; i < options.levels.size(); ++i) {
+    const LevelOption &level = options.levels[i];
+    std::unique_ptr<CacheLevel> cache =
+        makeCacheLevel("l" + std::to_string(i + 2), level.geometry,
+                       level.policy, LevelOption::WRITE, options.policySeed);
+    if (!cache) {
+      std::cerr << "FATAL: unknown replacement policy " << level.policy
+                << " (lru, plru, fifo, random, srrip or brrip)" << std::endl;
+      return EXIT_FAILURE;
     }
-    case 0b0110011: { // R-Type
-      const uint32_t shift = x[rs2] & 0x1F;
-      if (funct3 == 0b000 && funct7 == 0b0000000) { // add
-        const uint32_t data = x[rs1] + x[rs2];
-        files.output << hex_format(pc, 8) << ":add    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "+"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b000 && funct7 == 0b0100000) { // sub
-        const uint32_t data = x[rs1] - x[rs2];
-        files.output << hex_format(pc, 8) << ":sub    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "-"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b100 && funct7 == 0b0000000) { // xor
-        const uint32_t data = x[rs1] ^ x[rs2];
-        files.output << hex_format(pc, 8) << ":xor    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "^"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b110 && funct7 == 0b0000000) { // or
-        const uint32_t data = x[rs1] | x[rs2];
-        files.output << hex_format(pc, 8) << ":or     " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "|"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b111 && funct7 == 0b0000000) { // and
-        const uint32_t data = x[rs1] & x[rs2];
-        files.output << hex_format(pc, 8) << ":and    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "&"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b010 && funct7 == 0b0000000) { // slt
-        const uint32_t data =
-            (static_cast<int32_t>(x[rs1]) < static_cast<int32_t>(x[rs2])) ? 1
-                                                                          : 0;
-        files.output << hex_format(pc, 8) << ":slt    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "     "
-                     << x_label[rd] << "=(" << hex_format(x[rs1], 8) << "<"
-                     << hex_format(x[rs2], 8) << ")=" << std::dec << data
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b011 && funct7 == 0b0000000) { // sltu
-        const uint32_t data = (x[rs1] < x[rs2]) ? 1 : 0;
-        files.output << hex_format(pc, 8) << ":sltu   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "     "
-                     << x_label[rd] << "=(" << hex_format(x[rs1], 8) << "<"
-                     << hex_format(x[rs2], 8) << ")=" << std::dec << data
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b001 && funct7 == 0b0000000) { // sll
-        const uint32_t data = x[rs1] << shift;
-        files.output << hex_format(pc, 8) << ":sll    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "<<"
-                     << std::dec << shift << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b101 && funct7 == 0b0000000) { // srl
-        const uint32_t data = x[rs1] >> shift;
-        files.output << hex_format(pc, 8) << ":srl    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>"
-                     << std::dec << shift << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b101 && funct7 == 0b0100000) { // sra
-        const int32_t data = static_cast<int32_t>(x[rs1]) >> shift;
-        files.output << hex_format(pc, 8) << ":sra    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << ">>>"
-                     << std::dec << shift << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b000 && funct7 == 0b0000001) { // mul
-        const int64_t product =
-            static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
-            static_cast<int64_t>(static_cast<int32_t>(x[rs2]));
-        files.output << hex_format(pc, 8) << ":mul    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
-                     << hex_format(x[rs2], 8) << "="
-                     << hex_format(static_cast<uint32_t>(product), 8)
-                     << std::endl;
-        loadRd(static_cast<uint32_t>(product), rd, x);
-      } else if (funct3 == 0b001 && funct7 == 0b0000001) { // mulh
-        const int64_t product =
-            static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
-            static_cast<int64_t>(static_cast<int32_t>(x[rs2]));
-        files.output << hex_format(pc, 8) << ":mulh   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
-                     << hex_format(x[rs2], 8) << "="
-                     << hex_format(static_cast<uint32_t>(product >> 32), 8)
-                     << std::endl;
-        loadRd(static_cast<uint32_t>(product >> 32), rd, x);
-      } else if (funct3 == 0b010 && funct7 == 0b0000001) { // mulhsu
-        const int64_t product =
-            static_cast<int64_t>(static_cast<int32_t>(x[rs1])) *
-            static_cast<uint64_t>(x[rs2]);
-        files.output << hex_format(pc, 8) << ":mulhsu " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
-                     << hex_format(x[rs2], 8) << "="
-                     << hex_format(static_cast<uint32_t>(product >> 32), 8)
-                     << std::endl;
-        loadRd(static_cast<uint32_t>(product >> 32), rd, x);
-      } else if (funct3 == 0b011 && funct7 == 0b0000001) { // mulhu
-        const uint64_t product =
-            static_cast<uint64_t>(x[rs1]) * static_cast<uint64_t>(x[rs2]);
-        files.output << hex_format(pc, 8) << ":mulhu  " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "*"
-                     << hex_format(x[rs2], 8) << "="
-                     << hex_format(static_cast<uint32_t>(product >> 32), 8)
-                     << std::endl;
-        loadRd(static_cast<uint32_t>(product >> 32), rd, x);
-      } else if (funct3 == 0b100 && funct7 == 0b0000001) { // div
-        int32_t dividend = x[rs1];
-        int32_t divisor = x[rs2];
-        int32_t data;
-        if (divisor == 0)
-          data = -1;
-        else if (dividend == INT32_MIN && divisor == -1)
-          data = INT32_MIN;
-        else
-          data = dividend / divisor;
-        files.output << hex_format(pc, 8) << ":div    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "/"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b101 && funct7 == 0b0000001) { // divu
-        uint32_t dividend = x[rs1];
-        uint32_t divisor = x[rs2];
-        uint32_t data = (divisor == 0) ? UINT32_MAX : dividend / divisor;
-        files.output << hex_format(pc, 8) << ":divu   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "/"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b110 && funct7 == 0b0000001) { // rem
-        int32_t dividend = x[rs1];
-        int32_t divisor = x[rs2];
-        int32_t data;
-        if (divisor == 0)
-          data = dividend;
-        else if (dividend == INT32_MIN && divisor == -1)
-          data = 0;
-        else
-          data = dividend % divisor;
-        files.output << hex_format(pc, 8) << ":rem    " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "%"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      } else if (funct3 == 0b111 && funct7 == 0b0000001) { // remu
-        uint32_t dividend = x[rs1];
-        uint32_t divisor = x[rs2];
-        uint32_t data = (divisor == 0) ? dividend : dividend % divisor;
-        files.output << hex_format(pc, 8) << ":remu   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << x_label[rs2] << "       "
-                     << x_label[rd] << "=" << hex_format(x[rs1], 8) << "%"
-                     << hex_format(x[rs2], 8) << "=" << hex_format(data, 8)
-                     << std::endl;
-        loadRd(data, rd, x);
-      }
-      break;
+    hart.addLevel(std::move(cache));
+  }
+  if (options.missClasses) {
+    hart.iCache.classifyMisses();
+    hart.dCache.classifyMisses();
+    for (const auto &level : hart.levels)
+      level->classifyMisses();
+  }
+  std::unique_ptr<MissProfile> iProfile, dProfile;
+  if (options.missInterval) {
+    iProfile.reset(new MissProfile(options.iCache, hart.pc, hart.instret,
+                                   options.missInterval));
+    dProfile.reset(new MissProfile(options.dCache, hart.pc, hart.instret,
+                                   options.missInterval));
+    hart.iCache.profileMisses(iProfile.get());
+    hart.dCache.profileMisses(dProfile.get());
+  }
+  std::unique_ptr<ReuseDistance> iReuse, dReuse;
+  if (options.reuseLine) {
+    iReuse.reset(new ReuseDistance(options.reuseLine));
+    dReuse.reset(new ReuseDistance(options.reuseLine));
+    hart.iCache.listen(iReuse.get());
+    hart.dCache.listen(dReuse.get());
+  }
+  if (options.timing || options.mtimeCycles) {
+    CacheLatency latency = options.l1Latency;
+    latency.memory = options.dramLatency;
+    hart.iCache.setLatency(latency);
+    hart.dCache.setLatency(latency);
+    for (size_t i = 0; i < hart.levels.size(); ++i) {
+      latency = options.outerLatency[i];
+      latency.memory = options.dramLatency;
+      hart.levels[i]->setLatency(latency);
     }
-    case 0b1100011: { // B-Type
-      uint32_t nextPc = pc + 4;
-      bool taken = false;
-      if (funct3 == 0b000) { // beq
-        if (x[rs1] == x[rs2])
-          taken = true;
-      } else if (funct3 == 0b001) { // bne
-        if (x[rs1] != x[rs2])
-          taken = true;
-      } else if (funct3 == 0b100) { // blt
-        if (static_cast<int32_t>(x[rs1]) < static_cast<int32_t>(x[rs2]))
-          taken = true;
-      } else if (funct3 == 0b101) { // bge
-        if (static_cast<int32_t>(x[rs1]) >= static_cast<int32_t>(x[rs2]))
-          taken = true;
-      } else if (funct3 == 0b110) { // bltu
-        if (x[rs1] < x[rs2])
-          taken = true;
-      } else if (funct3 == 0b111) { // bgeu
-        if (x[rs1] >= x[rs2])
-          taken = true;
-      }
+    hart.mtimeCycles = options.mtimeCycles;
+  }
+  std::unique_ptr<CacheExplorer> explorer;
+  if (!options.explore.empty()) {
+    explorer.reset(new CacheExplorer(CacheExplorer::load(options.explore),
+                                     options.exploreThreads,
+                                     options.policySeed));
+    hart.iCache.listen(explorer.get());
+    hart.dCache.listen(explorer.get());
+  }
+  std::unique_ptr<AccessTraceWriter> accessTrace;
+  if (!options.accessTrace.empty()) {
+    accessTrace.reset(
+        new AccessTraceWriter(options.accessTrace, options.accessTraceDin));
+    hart.iCache.listen(accessTrace.get());
+    hart.dCache.listen(accessTrace.get());
+  }
+  if (options.comparePolicies) {
+    hart.iCache.comparePolicies(options.policySeed);
+    hart.dCache.comparePolicies(options.policySeed);
+  }
+  hart.jitEnabled = options.jit;
+  hart.jitLockstep = options.jitLockstep;
+  hart.jitThreshold = options.jitThreshold;
+  if (options.engine == Engine::TIERED)
+    hart.blockCache.threshold = options.tierThreshold;
+  if (options.asyncOutput)
+    files.startAsync(options.ringSize, options.ringFull);
+  if (options.mappedOutput)
+    files.startMapped();
 
-      if (taken)
-        nextPc = pc + branchImm;
-
-      files.output
-          << hex_format(pc, 8) << ":b"
-          << (funct3 == 0
-                  ? "eq"
-                  : (funct3 == 1
-                         ? "ne"
-                         : (funct3 == 4
-                                ? "lt"
-                                : (funct3 == 5
-                                       ? "ge"
-                                       : (funct3 == 6 ? "ltu" : "geu")))))
-          << "    " << x_label[rs1] << "," << x_label[rs2] << ","
-          << hex_format(branchImm, 3) << "        (" << hex_format(x[rs1], 8)
-          << (funct3 == 0
-                  ? "=="
-                  : (funct3 == 1
-                         ? "!="
-                         : (funct3 == 4
-                                ? "<"
-                                : (funct3 == 5 ? ">="
-                                               : (funct3 == 6 ? "<" : ">=")))))
-          << hex_format(x[rs2], 8) << ")=" << taken
-          << "->pc=" << hex_format(nextPc, 8) << std::endl;
-
-      if (taken)
-        pc = nextPc - 4;
-      break;
-    }
-    case 0b1101111: { // JAL
-      const uint32_t data = pc + 4;
-      const uint32_t address = pc + jalOffset;
-      files.output << hex_format(pc, 8) << ":jal    " << x_label[rd] << ","
-                   << hex_format((jalOffset / 2), 5)
-                   << "         pc=" << hex_format(address, 8) << ","
-                   << x_label[rd] << "=" << hex_format(data, 8) << std::endl;
-      loadRd(data, rd, x);
-      pc = address - 4;
-      break;
+  std::unique_ptr<FormatPool> formatPool;
+  if (options.formatThreads > 0) {
+    formatPool.reset(new FormatPool(files, hart, options.formatThreads,
+                                    options.formatChunk, options.trace));
+    hart.formatPool = formatPool.get();
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  switch (options.trace) {
+  case TraceMode::FULL:
+    if (formatPool)
+      hart.simulate<BinaryTrace>(options.engine);
+    else if (options.filter.enabled())
+      hart.simulate<FullTrace>(options.engine, options.filter);
+    else
+      hart.simulate<FullTrace>(options.engine);
+    break;
+  case TraceMode::CACHE:
+    if (formatPool)
+      hart.simulate<BinaryTrace>(options.engine);
+    else if (options.filter.enabled())
+      hart.simulate<CacheTrace>(options.engine, options.filter);
+    else
+      hart.simulate<CacheTrace>(options.engine);
+    break;
+  case TraceMode::STATS:
+    hart.simulate<StatsTrace>(options.engine);
+    break;
+  case TraceMode::NONE:
+    hart.simulate<NoTrace>(options.engine);
+    break;
+  case TraceMode::BINARY:
+    hart.writeTraceHeader(options.packedTrace);
+    hart.simulate<BinaryTrace>(options.engine);
+    hart.finishTrace();
+    break;
+  }
+  if (formatPool)
+    formatPool->finish();
+  files.output.flush();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (options.trace != TraceMode::NONE && options.trace != TraceMode::BINARY) {
+    hart.dCache.printStats();
+    hart.iCache.printStats();
+    for (const auto &level : hart.levels)
+      level->printStats(files.output);
+    if (options.cacheTraffic || !hart.levels.empty()) {
+      hart.dCache.printTraffic();
+      hart.iCache.printTraffic();
+      for (const auto &level : hart.levels)
+        level->printTraffic(files.output);
     }
-    case 0b1100111: { // JALR
-      if (funct3 == 0b000) {
-        const int32_t simm = signedImmediate(imm);
-        const uint32_t data = pc + 4;
-        uint32_t address = (x[rs1] + simm);
-        files.output << hex_format(pc, 8) << ":jalr   " << x_label[rd] << ","
-                     << x_label[rs1] << "," << hex_format(imm & 0xFFF, 3)
-                     << "    pc=" << hex_format(x[rs1], 8) << "+"
-                     << hex_format(simm, 8) << "," << x_label[rd] << "="
-                     << hex_format(data, 8) << std::endl;
-        loadRd(data, rd, x);
-        pc = (address & ~1) - 4;
-      }
-      break;
+    if (options.timing)
+      hart.printTiming();
+    if (dProfile) {
+      dProfile->print(files.output, "d", options.missTop);
+      iProfile->print(files.output, "i", options.missTop);
     }
-    case 0b1110011: { // SYSTEM
-      const uint16_t csrAddress = imm;
-      const uint8_t uimm_csr = rs1;
-      if (funct3 == 0b000 && csrAddress == 0) { // ecall
-        files.output << hex_format(pc, 8) << ":ecall" << std::endl;
-        triggerException(11, pc, pc, mepc, mcause, mtvec, mtval, mstatus);
-        files.output << ">exception:environment_call        cause="
-                     << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                     << ",tval=" << hex_format(mtval, 8) << std::endl;
-        continue;
-      } else if (funct3 == 0b000 && csrAddress == 0x302) { // mret
-        files.output << hex_format(pc, 8) << ":mret                         pc="
-                     << hex_format(mepc, 8) << std::endl;
-        uint32_t mpie = (mstatus >> 7) & 1;
-        mstatus &= ~(0b11 << 11);
-        mstatus |= (0b11 << 11);
-        mstatus &= ~(1 << 3);
-        mstatus |= (mpie << 3);
-        mstatus |= (1 << 7);
-        pc = mepc;
-        continue;
-      } else if (funct3 == 0b000 && csrAddress == 1) { // ebreak
-        files.output << hex_format(pc, 8) << ":ebreak" << std::endl;
-        run = false;
-      } else {
-        uint32_t oldCsrValue =
-            readCsr(csrAddress, mepc, mcause, mtvec, mtval, mstatus, mie, mip);
-        uint32_t newCsrValue;
-
-        switch (funct3) {
-        case 0b001: // CSRRW
-          newCsrValue = x[rs1];
-          files.output << hex_format(pc, 8) << ":csrrw  " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << x_label[rs1]
-                       << "       " << x_label[rd] << "="
-                       << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress) << "=" << x_label[rs1] << "="
-                       << hex_format(newCsrValue, 8) << std::endl;
-          writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
-                   mie, mip);
-          loadRd(oldCsrValue, rd, x);
-          break;
-        case 0b010: // CSRRS
-          newCsrValue = oldCsrValue | x[rs1];
-          files.output << hex_format(pc, 8) << ":csrrs  " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << x_label[rs1]
-                       << "       " << x_label[rd] << "="
-                       << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress) << "|=" << x_label[rs1] << "="
-                       << hex_format(oldCsrValue, 8) << "|"
-                       << hex_format(x[rs1], 8) << "="
-                       << hex_format(newCsrValue, 8) << std::endl;
-          loadRd(oldCsrValue, rd, x);
-          if (rs1 != 0) {
-            writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval,
-                     mstatus, mie, mip);
-          }
-          break;
-        case 0b011: // CSRRC
-          newCsrValue = oldCsrValue & ~x[rs1];
-          files.output << hex_format(pc, 8) << ":csrrc  " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << x_label[rs1]
-                       << "       " << x_label[rd] << "="
-                       << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress) << "&~=" << x_label[rs1] << "="
-                       << hex_format(oldCsrValue, 8) << "&~"
-                       << hex_format(x[rs1], 8) << "="
-                       << hex_format(newCsrValue, 8) << std::endl;
-          loadRd(oldCsrValue, rd, x);
-          if (rs1 != 0) {
-            writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval,
-                     mstatus, mie, mip);
-          }
-          break;
-        case 0b101: // CSRRWI
-          newCsrValue = uimm_csr;
-          files.output << hex_format(pc, 8) << ":csrrwi " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << std::dec
-                       << static_cast<unsigned int>(uimm_csr) << "        "
-                       << x_label[rd] << "=" << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress)
-                       << "=u5=" << hex_format(newCsrValue, 8) << std::endl;
-          writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval, mstatus,
-                   mie, mip);
-          loadRd(oldCsrValue, rd, x);
-          break;
-        case 0b110: // CSRRSI
-          newCsrValue = oldCsrValue | uimm_csr;
-          files.output << hex_format(pc, 8) << ":csrrsi " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << std::dec
-                       << static_cast<unsigned int>(uimm_csr) << "        "
-                       << x_label[rd] << "=" << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress)
-                       << "|=u5=" << hex_format(oldCsrValue, 8) << "|"
-                       << hex_format(uimm_csr, 8) << "="
-                       << hex_format(newCsrValue, 8) << std::endl;
-          loadRd(oldCsrValue, rd, x);
-          if (uimm_csr != 0) {
-            writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval,
-                     mstatus, mie, mip);
-          }
-          break;
-        case 0b111: // CSRRCI
-          newCsrValue = oldCsrValue & ~uimm_csr;
-          files.output << hex_format(pc, 8) << ":csrrci " << x_label[rd] << ","
-                       << getCsrName(csrAddress) << "," << std::dec
-                       << static_cast<unsigned int>(uimm_csr) << "        "
-                       << x_label[rd] << "=" << getCsrName(csrAddress) << "="
-                       << hex_format(oldCsrValue, 8) << ","
-                       << getCsrName(csrAddress)
-                       << "&~=u5=" << hex_format(oldCsrValue, 8) << "&~"
-                       << hex_format(uimm_csr, 8) << "="
-                       << hex_format(newCsrValue, 8) << std::endl;
-          loadRd(oldCsrValue, rd, x);
-          if (uimm_csr != 0) {
-            writeCsr(csrAddress, newCsrValue, mepc, mcause, mtvec, mtval,
-                     mstatus, mie, mip);
-          }
-          break;
-        default:
-          triggerException(2, instruction, pc, mepc, mcause, mtvec, mtval,
-                           mstatus);
-          files.output << ">exception:illegal_instruction   cause="
-                       << hex_format(mcause, 8)
-                       << ",epc=" << hex_format(mepc, 8)
-                       << ",tval=" << hex_format(instruction, 8) << std::endl;
-          continue;
-        }
-      }
-      break;
+    if (dReuse) {
+      dReuse->print(files.output, "d");
+      iReuse->print(files.output, "i");
     }
-    default:
-      triggerException(2, instruction, pc, mepc, mcause, mtvec, mtval, mstatus);
-      files.output << ">exception:illegal_instruction   cause="
-                   << hex_format(mcause, 8) << ",epc=" << hex_format(mepc, 8)
-                   << ",tval=" << hex_format(instruction, 8) << std::endl;
-      continue;
+    if (explorer) {
+      explorer->finish();
+      explorer->print(files.output);
     }
-
-    pc += 4;
-    mtime++;
+    if (options.engine == Engine::TIERED)
+      hart.printTierStats();
   }
 
-  dCache.printStats();
-  iCache.printStats();
+  if (options.perf) {
+    std::cerr << hart.instret << " instructions in " << elapsed.count()
+              << " s (" << hart.instret / elapsed.count() / 1e6 << " MIPS)"
+              << std::endl;
+    if (files.output.lines > 0)
+      std::cerr << files.output.lines << " trace lines ("
+                << files.output.lines / elapsed.count() << " lines/s)"
+                << std::endl;
+  }
+  if (files.output.droppedLines > 0) {
+    std::cerr << "WARNING: " << files.output.droppedLines
+              << " trace lines dropped (ring full)" << std::endl;
+  }
 
   return 0;
 }
+#endif
@@ -0,0 +1,217 @@
+// Renders a binary or packed trace written by `poximv3 ... --trace=binary`
+// or `--trace=packed` back into the text trace, byte for byte:
+//
+//   g++ -O2 -o tracerender tracerender.cpp
+//   ./tracerender <trace.bin> <output.out>
+//   ./tracerender <trace.bin> <output.out> --from=N [--count=K]
+//
+// The memory image stored in the header is replayed through the emulator's
+// own instruction handlers and caches, built with the geometry and write
+// policy the header records, so every line (instructions,
+// #cache_mem: events, >exception: and >interrupt:) comes from the same code
+// that writes the text trace. The records say where interrupts and faults
+// were taken and are checked against the replay as it goes.
+//
+// --from lists the records themselves, starting at instruction N. In a
+// packed trace the block index takes the reader there directly.
+#define POXIM_NO_MAIN
+#include "poximv3.cpp"
+
+// Reads the records of either trace format in order. `instructions` counts
+// the INSTRUCTION and EXCEPTION records returned so far.
+class TraceReader {
+public:
+  TraceHeader header = {};
+  std::vector<uint8_t> image;
+  bool packed = false;
+  uint64_t instructions = 0;
+
+  explicit TraceReader(const char *path) : input(path, std::ios::binary) {
+    input.read(reinterpret_cast<char *>(&header), sizeof(header));
+    packed = std::memcmp(header.magic, TraceHeader::PACKED_MAGIC, 8) == 0;
+    if (!input ||
+        (!packed && std::memcmp(header.magic, TraceHeader::MAGIC, 8) != 0) ||
+        header.recordSize != sizeof(TraceRecord) ||
+        header.memoryBase != MemoryMap::OFFSET)
+      fail(path, "not a binary trace");
+    if (!geometry(header.iCache).valid() || !geometry(header.dCache).valid() ||
+        header.dWriteHit > 1 || header.dWriteMiss > 1)
+      fail(path, "bad cache configuration in the header");
+    image.resize(header.memorySize);
+    input.read(reinterpret_cast<char *>(image.data()), image.size());
+    if (!input)
+      fail(path, "truncated memory image");
+    if (packed)
+      readIndex(path);
+  }
+
+  static CacheGeometry geometry(const std::array<uint32_t, 3> &shape) {
+    return CacheGeometry(shape[0], shape[1], shape[2]);
+  }
+
+  WritePolicy dWrite() const {
+    return {static_cast<WriteHit>(header.dWriteHit),
+            static_cast<WriteMiss>(header.dWriteMiss)};
+  }
+
+  bool next(TraceRecord &record) {
+    if (!packed) {
+      if (!input.read(reinterpret_cast<char *>(&record), sizeof(record)))
+        return false;
+    } else {
+      while (position == payload.size()) {
+        if (nextBlock == index.size())
+          return false;
+        loadBlock(nextBlock++);
+      }
+      const uint8_t *in = payload.data() + position;
+      if (!codec.decode(in, payload.data() + payload.size(), record))
+        fail("packed trace", "truncated block");
+      position = in - payload.data();
+    }
+    instructions += isInstruction(record.kind);
+    return true;
+  }
+
+  // Call before the first next(). Skips to the first record after
+  // instruction `target` - 1: the traps taken just before it, if any, or the
+  // instruction itself. A packed trace starts decoding at the last block that
+  // begins before it.
+  void seek(uint64_t target) {
+    if (packed && !index.empty()) {
+      size_t block = 0;
+      while (block + 1 < index.size() && index[block + 1].instruction < target)
+        block++;
+      loadBlock(block);
+      nextBlock = block + 1;
+      instructions = index[block].instruction;
+    }
+    TraceRecord record;
+    while (instructions < target && next(record)) {
+    }
+  }
+
+private:
+  std::ifstream input;
+  std::vector<PackedIndexEntry> index;
+  size_t nextBlock = 0;
+  std::vector<uint8_t> payload;
+  size_t position = 0;
+  TraceCodec codec;
+
+  [[noreturn]] static void fail(const char *what, const char *why) {
+    std::cerr << "FATAL: " << what << ": " << why << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  void readIndex(const char *path) {
+    const std::streampos start = input.tellg();
+    PackedTrailer trailer = {};
+    input.seekg(-static_cast<std::streamoff>(sizeof(trailer)), std::ios::end);
+    input.read(reinterpret_cast<char *>(&trailer), sizeof(trailer));
+    if (!input || std::memcmp(trailer.magic, PackedTrailer::MAGIC, 8) != 0)
+      fail(path, "packed trace has no index (was the run cut short?)");
+    index.resize(trailer.blocks);
+    input.seekg(trailer.indexOffset);
+    input.read(reinterpret_cast<char *>(index.data()),
+               index.size() * sizeof(PackedIndexEntry));
+    if (!input)
+      fail(path, "truncated index");
+    input.seekg(start);
+  }
+
+  void loadBlock(size_t block) {
+    PackedBlock framing = {};
+    input.seekg(index[block].offset);
+    input.read(reinterpret_cast<char *>(&framing), sizeof(framing));
+    payload.resize(framing.payloadSize);
+    input.read(reinterpret_cast<char *>(payload.data()), payload.size());
+    if (!input)
+      fail("packed trace", "truncated block");
+    position = 0;
+    codec = TraceCodec();
+  }
+};
+
+[[noreturn]] void diverged(uint64_t index, const TraceRecord &record,
+                           const char *what) {
+  std::cerr << "FATAL: record " << index << " (pc=" << hex_format(record.pc, 8)
+            << ") does not match the replay: " << what << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int render(TraceReader &reader, const char *outputPath) {
+  Files files(outputPath);
+  Hart hart(files, reader.image.size(),
+            TraceReader::geometry(reader.header.iCache),
+            TraceReader::geometry(reader.header.dCache));
+  hart.dCache.setWritePolicy(reader.dWrite());
+  std::copy(reader.image.begin(), reader.image.end(), hart.mem.begin());
+
+  TraceRecord record;
+  for (uint64_t index = 0; reader.next(record); ++index) {
+    if (const char *what = hart.replay<FullTrace>(record))
+      diverged(index, record, what);
+  }
+
+  hart.dCache.printStats();
+  hart.iCache.printStats();
+  return 0;
+}
+
+// One line per record, starting at instruction `from`.
+int list(TraceReader &reader, const char *outputPath, uint64_t from,
+         uint64_t count) {
+  static constexpr std::array<std::string_view, 4> kinds = {
+      "instruction", "exception", "interrupt", "fetch_fault"};
+  std::ofstream output(outputPath);
+  if (!output.is_open()) {
+    std::cerr << "FATAL: Failed to open " << outputPath << std::endl;
+    return EXIT_FAILURE;
+  }
+  reader.seek(from);
+  TraceRecord record;
+  while (count > 0 && reader.next(record)) {
+    const uint64_t instruction =
+        reader.instructions - isInstruction(record.kind);
+    output << "#" << instruction << " " << kinds[static_cast<int>(record.kind)]
+           << " pc=" << hex_format(record.pc, 8)
+           << " raw=" << hex_format(record.raw, 8)
+           << " value=" << hex_format(record.value, 8)
+           << " address=" << hex_format(record.address, 8)
+           << " next=" << hex_format(record.nextPc, 8)
+           << " i=" << hex_format(record.iCache, 8)
+           << " d=" << hex_format(record.dCache, 8) << '\n';
+    count -= isInstruction(record.kind);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <trace.bin> <output_file> [--from=N [--count=K]]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  bool listing = false;
+  uint64_t from = 0, count = UINT64_MAX;
+  for (int i = 3; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--from=", 0) == 0) {
+      listing = true;
+      from = optionNumber<uint64_t>(arg, 7);
+    } else if (arg.rfind("--count=", 0) == 0) {
+      listing = true;
+      count = optionNumber<uint64_t>(arg, 8);
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  TraceReader reader(argv[1]);
+  if (listing)
+    return list(reader, argv[2], from, count);
+  return render(reader, argv[2]);
+}